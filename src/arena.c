@@ -0,0 +1,88 @@
+#include "arena.h"
+#include <stdint.h>
+#include <stdlib.h>
+
+// Smallest block an arena allocates
+#define ARENA_MIN_BLOCK_SIZE (64 * 1024)
+
+struct arena_block {
+  arena_block_t *next; // the block allocated before this one
+  unsigned char *data; // ARENA_ALIGNMENT aligned start of the memory
+  size_t size;         // bytes of memory at data
+  size_t used;         // bytes of it handed out
+};
+
+static arena_block_t *allocate_block(size_t size, arena_block_t *next) {
+  arena_block_t *block =
+      (arena_block_t *)malloc(sizeof(arena_block_t) + size + ARENA_ALIGNMENT);
+  if (block == NULL) {
+    return NULL;
+  }
+  uintptr_t data = (uintptr_t)(block + 1);
+  data = (data + ARENA_ALIGNMENT - 1) & ~(uintptr_t)(ARENA_ALIGNMENT - 1);
+  block->next = next;
+  block->data = (unsigned char *)data;
+  block->size = size;
+  block->used = 0;
+  return block;
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+  size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+  SDL_AtomicLock(&arena->lock);
+  arena_block_t *block = arena->blocks;
+  if (block == NULL || block->size - block->used < size) {
+    // Double the size with every block, so a frame that needs a lot more
+    // than the last one only takes a few of them
+    size_t block_size = block ? block->size * 2 : ARENA_MIN_BLOCK_SIZE;
+    if (block_size < size) {
+      block_size = size;
+    }
+    block = allocate_block(block_size, block);
+    if (block == NULL) {
+      SDL_AtomicUnlock(&arena->lock);
+      return NULL;
+    }
+    arena->blocks = block;
+  }
+
+  void *memory = block->data + block->used;
+  block->used += size;
+  arena->used += size;
+  if (arena->used > arena->high_water_mark) {
+    arena->high_water_mark = arena->used;
+  }
+  SDL_AtomicUnlock(&arena->lock);
+  return memory;
+}
+
+void arena_reset(arena_t *arena) {
+  arena_block_t *block = arena->blocks;
+  if (block != NULL && block->next != NULL) {
+    // Whatever is left at the end of the full blocks counts too, so the
+    // merged block fits all the allocations whatever order they come in
+    size_t total_size = 0;
+    while (block != NULL) {
+      arena_block_t *next = block->next;
+      total_size += block->size;
+      free(block);
+      block = next;
+    }
+    arena->blocks = allocate_block(total_size, NULL);
+  } else if (block != NULL) {
+    block->used = 0;
+  }
+  arena->used = 0;
+}
+
+void arena_free(arena_t *arena) {
+  arena_block_t *block = arena->blocks;
+  while (block != NULL) {
+    arena_block_t *next = block->next;
+    free(block);
+    block = next;
+  }
+  arena->blocks = NULL;
+  arena->used = 0;
+}
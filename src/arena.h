@@ -0,0 +1,49 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <SDL2/SDL.h>
+#include <stddef.h>
+
+// Allocations from an arena are aligned to a cache line, so memory handed to
+// different threads never shares one
+#define ARENA_ALIGNMENT 64
+
+typedef struct arena_block arena_block_t;
+
+// arena_t is a linear allocator for memory that lives until the next reset,
+// typically one frame. Allocating bumps a pointer, and a reset takes all of
+// it back at once without freeing anything, so once an arena has grown to
+// what a frame needs it does no heap allocation at all. A zeroed arena_t is
+// an empty arena
+typedef struct {
+  arena_block_t *blocks;  // the block allocations come from, the full ones
+                          // after it
+  size_t used;            // bytes handed out since the last reset
+  size_t high_water_mark; // most bytes ever handed out between two resets
+  SDL_SpinLock lock;
+} arena_t;
+
+/**
+ * Allocate memory from an arena, growing it by another block if the current
+ * one is full. Safe to call from several threads at once
+ *
+ * @param  arena: the arena
+ * @param  size: number of bytes
+ * @return the memory, ARENA_ALIGNMENT aligned, or NULL if the arena could not
+ *         grow
+ */
+void *arena_alloc(arena_t *arena, size_t size);
+
+/**
+ * Take back everything allocated from an arena. If it had to grow more than
+ * one block since the last reset, those are merged into a single block big
+ * enough for all of them, so the same allocations fit in one go next time
+ */
+void arena_reset(arena_t *arena);
+
+/**
+ * Free all memory of an arena, leaving it empty
+ */
+void arena_free(arena_t *arena);
+
+#endif
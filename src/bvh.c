@@ -0,0 +1,179 @@
+#include "bvh.h"
+#include "clipping.h"
+#include <math.h>
+#include <stdlib.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Bounding volume hierarchy over the faces of a mesh
+///////////////////////////////////////////////////////////////////////////////
+// The hierarchy is built top down: the faces of a node are sorted by the
+// center of their bounding box along the longest axis of the node, and split
+// into two halves of equal count, until at most BVH_LEAF_FACES are left. The
+// faces end up in the order of the leaves, so every subtree covers a run of
+// consecutive faces, and a subtree entirely inside the frustum is one run
+// however many leaves it has.
+//
+// Splitting by count keeps the tree balanced, so it is at most about
+// log2(faces / BVH_LEAF_FACES) deep and a small fixed stack is enough to walk
+// it.
+///////////////////////////////////////////////////////////////////////////////
+
+#define BVH_MAX_DEPTH 64
+
+typedef struct {
+  face_t face;
+  vec3_t min; // bounding box of the face
+  vec3_t max;
+  vec3_t center;
+} bvh_item_t;
+
+typedef struct {
+  bvh_item_t *items;
+  bvh_node_t *nodes;
+  int num_nodes;
+} bvh_builder_t;
+
+static int sort_axis = 0;
+
+static float axis_value(vec3_t v, int axis) {
+  return axis == 0 ? v.x : axis == 1 ? v.y : v.z;
+}
+
+static int compare_items(const void *a, const void *b) {
+  float center_a = axis_value(((const bvh_item_t *)a)->center, sort_axis);
+  float center_b = axis_value(((const bvh_item_t *)b)->center, sort_axis);
+  return (center_a > center_b) - (center_a < center_b);
+}
+
+static vec3_t vec3_min(vec3_t a, vec3_t b) {
+  return vec3_new(fminf(a.x, b.x), fminf(a.y, b.y), fminf(a.z, b.z));
+}
+
+static vec3_t vec3_max(vec3_t a, vec3_t b) {
+  return vec3_new(fmaxf(a.x, b.x), fmaxf(a.y, b.y), fmaxf(a.z, b.z));
+}
+
+// Build the subtree over items first to first + count - 1, returning the index
+// of its root
+static int build_node(bvh_builder_t *builder, int first, int count) {
+  int index = builder->num_nodes++;
+  bvh_node_t *node = &builder->nodes[index];
+  node->first_face = first;
+  node->num_faces = count;
+  node->right_child = 0;
+  node->min = builder->items[first].min;
+  node->max = builder->items[first].max;
+  vec3_t center_min = builder->items[first].center;
+  vec3_t center_max = center_min;
+  for (int i = first + 1; i < first + count; i++) {
+    node->min = vec3_min(node->min, builder->items[i].min);
+    node->max = vec3_max(node->max, builder->items[i].max);
+    center_min = vec3_min(center_min, builder->items[i].center);
+    center_max = vec3_max(center_max, builder->items[i].center);
+  }
+  if (count <= BVH_LEAF_FACES) {
+    return index;
+  }
+
+  vec3_t extent = vec3_sub(center_max, center_min);
+  sort_axis = extent.x >= extent.y && extent.x >= extent.z ? 0
+              : extent.y >= extent.z                       ? 1
+                                                           : 2;
+  qsort(&builder->items[first], count, sizeof(bvh_item_t), compare_items);
+
+  int left_count = count / 2;
+  build_node(builder, first, left_count);
+  node->right_child =
+      build_node(builder, first + left_count, count - left_count);
+  return index;
+}
+
+bvh_node_t *build_bvh(const vec3_t *vertices, face_t *faces, int num_faces,
+                      int *num_nodes) {
+  *num_nodes = 0;
+  if (num_faces == 0) {
+    return NULL;
+  }
+
+  // A binary tree with at least one face in every leaf has fewer than twice
+  // as many nodes as faces
+  bvh_builder_t builder = {
+      .items = (bvh_item_t *)malloc(sizeof(bvh_item_t) * num_faces),
+      .nodes = (bvh_node_t *)malloc(sizeof(bvh_node_t) * (2 * num_faces - 1)),
+      .num_nodes = 0};
+  if (builder.items == NULL || builder.nodes == NULL) {
+    free(builder.items);
+    free(builder.nodes);
+    return NULL;
+  }
+
+  for (int i = 0; i < num_faces; i++) {
+    vec3_t a = vertices[faces[i].a - 1];
+    vec3_t b = vertices[faces[i].b - 1];
+    vec3_t c = vertices[faces[i].c - 1];
+    bvh_item_t *item = &builder.items[i];
+    item->face = faces[i];
+    item->min = vec3_min(a, vec3_min(b, c));
+    item->max = vec3_max(a, vec3_max(b, c));
+    item->center = vec3_mul(vec3_add(item->min, item->max), 0.5);
+  }
+  build_node(&builder, 0, num_faces);
+
+  for (int i = 0; i < num_faces; i++) {
+    faces[i] = builder.items[i].face;
+  }
+  free(builder.items);
+
+  bvh_node_t *nodes = (bvh_node_t *)realloc(
+      builder.nodes, sizeof(bvh_node_t) * builder.num_nodes);
+  if (nodes == NULL) {
+    nodes = builder.nodes;
+  }
+  *num_nodes = builder.num_nodes;
+  return nodes;
+}
+
+// Append a run of faces, merging it into the last run when it carries on
+// from it
+static int add_run(face_run_t runs[], int num_runs, int first_face,
+                   int num_faces, bool is_inside) {
+  if (num_runs > 0) {
+    face_run_t *last = &runs[num_runs - 1];
+    if (last->is_inside == is_inside &&
+        last->first_face + last->num_faces == first_face) {
+      last->num_faces += num_faces;
+      return num_runs;
+    }
+  }
+  runs[num_runs] =
+      (face_run_t){.first_face = first_face, .num_faces = num_faces,
+                   .is_inside = is_inside};
+  return num_runs + 1;
+}
+
+int collect_visible_faces(const bvh_node_t *nodes, const vec4_t planes[],
+                          face_run_t runs[]) {
+  int num_runs = 0;
+  int stack[BVH_MAX_DEPTH];
+  int stack_size = 0;
+  stack[stack_size++] = 0;
+
+  while (stack_size > 0) {
+    const bvh_node_t *node = &nodes[stack[--stack_size]];
+    int result = classify_box_in_planes(planes, node->min, node->max);
+    if (result == FRUSTUM_OUTSIDE) {
+      continue;
+    }
+    if (result == FRUSTUM_INSIDE || node->right_child == 0) {
+      num_runs = add_run(runs, num_runs, node->first_face, node->num_faces,
+                         result == FRUSTUM_INSIDE);
+      continue;
+    }
+
+    // Right child first, so the left one is walked first and the runs come
+    // out in face order
+    stack[stack_size++] = node->right_child;
+    stack[stack_size++] = node - nodes + 1;
+  }
+  return num_runs;
+}
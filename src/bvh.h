@@ -0,0 +1,60 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "triangle.h"
+#include "vector.h"
+#include <stdbool.h>
+
+// Faces a leaf of the hierarchy holds at most
+#define BVH_LEAF_FACES 16
+
+// bvh_node_t is a node of a bounding volume hierarchy over the faces of a
+// mesh, stored depth first: the left child of an inner node is the node right
+// after it. The faces below any node are a run of consecutive faces of the
+// mesh
+typedef struct {
+  vec3_t min; // object space bounding box of the faces below the node
+  vec3_t max;
+  int first_face;  // first face of the run
+  int num_faces;   // number of faces in the run
+  int right_child; // index of the right child, 0 for leaves
+} bvh_node_t;
+
+// face_run_t is a run of consecutive faces that may be visible, and whether
+// all of them are inside the frustum so they need no clipping
+typedef struct {
+  int first_face;
+  int num_faces;
+  bool is_inside;
+} face_run_t;
+
+/**
+ * Build a hierarchy over the faces of a mesh. The faces are reordered so the
+ * faces of every leaf are consecutive
+ *
+ * @param  vertices: vertices of the mesh, indexed by the faces from 1
+ * @param  faces: faces of the mesh, reordered in place
+ * @param  num_faces: number of faces
+ * @param  num_nodes: set to the number of nodes built
+ * @return the nodes, the root first, or NULL if there are no faces or they
+ *         could not be allocated
+ */
+bvh_node_t *build_bvh(const vec3_t *vertices, face_t *faces, int num_faces,
+                      int *num_nodes);
+
+/**
+ * Walk a hierarchy against frustum planes given in its object space (see
+ * transform_frustum_planes()) and gather the runs of faces in leaves that are
+ * not entirely outside. Subtrees entirely outside are skipped without
+ * visiting their nodes, and subtrees entirely inside are taken whole without
+ * testing further. Neighbouring runs are merged
+ *
+ * @param  nodes: nodes of the hierarchy, the root first
+ * @param  planes: the frustum planes as plane equations
+ * @param  runs: filled with the runs, room for one per leaf is enough
+ * @return the number of runs
+ */
+int collect_visible_faces(const bvh_node_t *nodes, const vec4_t planes[],
+                          face_run_t runs[]);
+
+#endif
@@ -60,3 +60,27 @@ vec3_t get_camera_lookat_target(void) {
 
   return target;
 }
+
+// Camera position and angles the last view matrix was built from
+static bool view_valid = false;
+static vec3_t view_position;
+static float view_yaw_angle;
+static float view_pitch_angle;
+
+bool update_camera_view_matrix(mat4_t *view_matrix) {
+  if (view_valid && vec3_equal(camera.position, view_position) &&
+      camera.yaw_angle == view_yaw_angle &&
+      camera.pitch_angle == view_pitch_angle) {
+    return false;
+  }
+  view_valid = true;
+  view_position = camera.position;
+  view_yaw_angle = camera.yaw_angle;
+  view_pitch_angle = camera.pitch_angle;
+
+  // Update camera look at target to create view matrix
+  vec3_t target = get_camera_lookat_target();
+  vec3_t up_direction = vec3_new(0, 1, 0);
+  *view_matrix = mat4_look_at(camera.position, target, up_direction);
+  return true;
+}
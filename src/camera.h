@@ -3,6 +3,7 @@
 
 #include "matrix.h"
 #include "vector.h"
+#include <stdbool.h>
 
 typedef struct {
   vec3_t position;
@@ -32,4 +33,12 @@ float get_camera_pitch();
 
 vec3_t get_camera_lookat_target(void);
 
+/**
+ * Rebuild the view matrix if the camera moved or turned since the last call
+ *
+ * @param  view_matrix: receives the view matrix when it is rebuilt
+ * @return boolean: whether the view matrix changed
+ */
+bool update_camera_view_matrix(mat4_t *view_matrix);
+
 #endif
@@ -1,8 +1,16 @@
 #include "clipping.h"
 #include <math.h>
 
-#define NUM_PLANES 6
-plane_t frustum_planes[NUM_PLANES];
+#define NUM_PLANES NUM_FRUSTUM_PLANES
+#define NUM_GUARD_BAND_PLANES 4
+plane_t frustum_planes[NUM_PLANES + NUM_GUARD_BAND_PLANES];
+
+#define SIDE_PLANES                                                            \
+  ((1 << LEFT_FRUSTUM_PLANE) | (1 << RIGHT_FRUSTUM_PLANE) |                    \
+   (1 << TOP_FRUSTUM_PLANE) | (1 << BOTTOM_FRUSTUM_PLANE))
+
+static int clipping_mode = CLIP_GUARD_BAND;
+static int clipping_space = CLIP_HOMOGENEOUS;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Frustum planes are defined by a point and a normal vector
@@ -13,6 +21,9 @@ plane_t frustum_planes[NUM_PLANES];
 // Bottom plane :  P=(0, 0, 0),     N=(0, cos(fov/2), sin(fov/2))
 // Left plane   :  P=(0, 0, 0),     N=(cos(fov/2), 0, sin(fov/2))
 // Right plane  :  P=(0, 0, 0),     N=(-cos(fov/2), 0, sin(fov/2))
+//
+// The guard band planes are the four side planes again, opened up until they
+// enclose GUARD_BAND_SCALE times the width and height of the window
 ///////////////////////////////////////////////////////////////////////////////
 //
 //           /|\
@@ -61,8 +72,35 @@ void init_frustum_planes(float fov_x, float fov_y, float z_near, float z_far) {
   frustum_planes[FAR_FRUSTUM_PLANE].normal.x = 0;
   frustum_planes[FAR_FRUSTUM_PLANE].normal.y = 0;
   frustum_planes[FAR_FRUSTUM_PLANE].normal.z = -1;
+
+  float guard_fov_x = atan(tan(fov_x / 2) * GUARD_BAND_SCALE) * 2;
+  float guard_fov_y = atan(tan(fov_y / 2) * GUARD_BAND_SCALE) * 2;
+  float cos_half_guard_x = cos(guard_fov_x / 2);
+  float sin_half_guard_x = sin(guard_fov_x / 2);
+  float cos_half_guard_y = cos(guard_fov_y / 2);
+  float sin_half_guard_y = sin(guard_fov_y / 2);
+
+  frustum_planes[LEFT_GUARD_BAND_PLANE].point = vec3_new(0, 0, 0);
+  frustum_planes[LEFT_GUARD_BAND_PLANE].normal =
+      vec3_new(cos_half_guard_x, 0, sin_half_guard_x);
+
+  frustum_planes[RIGHT_GUARD_BAND_PLANE].point = vec3_new(0, 0, 0);
+  frustum_planes[RIGHT_GUARD_BAND_PLANE].normal =
+      vec3_new(-cos_half_guard_x, 0, sin_half_guard_x);
+
+  frustum_planes[TOP_GUARD_BAND_PLANE].point = vec3_new(0, 0, 0);
+  frustum_planes[TOP_GUARD_BAND_PLANE].normal =
+      vec3_new(0, -cos_half_guard_y, sin_half_guard_y);
+
+  frustum_planes[BOTTOM_GUARD_BAND_PLANE].point = vec3_new(0, 0, 0);
+  frustum_planes[BOTTOM_GUARD_BAND_PLANE].normal =
+      vec3_new(0, cos_half_guard_y, sin_half_guard_y);
 }
 
+void set_clipping_mode(int mode) { clipping_mode = mode; }
+
+bool is_clipping_guard_band(void) { return clipping_mode == CLIP_GUARD_BAND; }
+
 void triangles_from_polygon(polygon_t *polygon, triangle_t triangles[],
                             int *num_triangles) {
   for (int i = 0; i < polygon->num_vertices - 2; i++) {
@@ -90,24 +128,26 @@ polygon_t create_polygon_from_triangle(vec3_t v0, vec3_t v1, vec3_t v2,
 
 float float_lerp(float a, float b, float t) { return a + t * (b - a); }
 
-void clip_polygon_against_plane(polygon_t *polygon, int plane) {
+// Clip source against one plane into result, which must be another polygon
+static void clip_polygon_into(const polygon_t *source, polygon_t *result,
+                              int plane) {
   vec3_t plane_point = frustum_planes[plane].point;
   vec3_t plane_normal = frustum_planes[plane].normal;
-
-  // Declare a static array of inside vertices that will be part of the final
-  // polygon returned via parameter
-  vec3_t inside_vertices[MAX_POLY_VERTICES];
-  tex2_t inside_texcoords[MAX_POLY_VERTICES];
   int num_inside_vertices = 0;
+  if (source->num_vertices == 0) {
+    result->num_vertices = 0;
+    return;
+  }
 
   // Start the current vertex with the first polygon vertex and texture
   // coordinate
-  vec3_t *current_vertex = &polygon->vertices[0];
-  tex2_t *current_texcoord = &polygon->texcoords[0];
+  const vec3_t *current_vertex = &source->vertices[0];
+  const tex2_t *current_texcoord = &source->texcoords[0];
 
   // Start previous vertex with last polgyon vertex and texture coordinate
-  vec3_t *previous_vertex = &polygon->vertices[polygon->num_vertices - 1];
-  tex2_t *previous_texcoord = &polygon->texcoords[polygon->num_vertices - 1];
+  const vec3_t *previous_vertex = &source->vertices[source->num_vertices - 1];
+  const tex2_t *previous_texcoord =
+      &source->texcoords[source->num_vertices - 1];
 
   // Calculate the dot product of the current and previous vertex
   float current_dot = 0;
@@ -116,7 +156,7 @@ void clip_polygon_against_plane(polygon_t *polygon, int plane) {
 
   // Loop all the polygon vertices while the current is different than the last
   // one
-  while (current_vertex != &polygon->vertices[polygon->num_vertices]) {
+  while (current_vertex != &source->vertices[source->num_vertices]) {
     current_dot =
         vec3_dot(vec3_sub(*current_vertex, plane_point), plane_normal);
 
@@ -137,17 +177,16 @@ void clip_polygon_against_plane(polygon_t *polygon, int plane) {
           .v = float_lerp(previous_texcoord->v, current_texcoord->v, t)};
 
       // Insert the intersection point to the list of "inside vertices"
-      inside_vertices[num_inside_vertices] = vec3_clone(&intersection_point);
-      inside_texcoords[num_inside_vertices] =
-          tex2_clone(&interpolated_texcoord);
+      result->vertices[num_inside_vertices] = intersection_point;
+      result->texcoords[num_inside_vertices] = interpolated_texcoord;
       num_inside_vertices++;
     }
 
     // Current vertex is inside the plane
     if (current_dot > 0) {
       // Insert the current vertex to the list of "inside vertices"
-      inside_vertices[num_inside_vertices] = vec3_clone(current_vertex);
-      inside_texcoords[num_inside_vertices] = tex2_clone(current_texcoord);
+      result->vertices[num_inside_vertices] = *current_vertex;
+      result->texcoords[num_inside_vertices] = *current_texcoord;
       num_inside_vertices++;
     }
 
@@ -158,21 +197,354 @@ void clip_polygon_against_plane(polygon_t *polygon, int plane) {
     current_vertex++;
     current_texcoord++;
   }
+  result->num_vertices = num_inside_vertices;
+}
+
+void clip_polygon_against_plane(polygon_t *polygon, int plane) {
+  polygon_t clipped;
+  clip_polygon_into(polygon, &clipped, plane);
+  *polygon = clipped;
+}
+
+static bool is_outside_plane(vec3_t point, int plane) {
+  return vec3_dot(vec3_sub(point, frustum_planes[plane].point),
+                  frustum_planes[plane].normal) <= 0;
+}
 
-  // At the end, copy the list of inside vertices into the destination polygon
-  // (out parameter)
-  for (int i = 0; i < num_inside_vertices; i++) {
-    polygon->vertices[i] = vec3_clone(&inside_vertices[i]);
-    polygon->texcoords[i] = tex2_clone(&inside_texcoords[i]);
+/**
+ * Outcode of a camera space point: one bit (1 << plane) for every frustum
+ * plane the point is not strictly inside of. A point with an outcode of 0 is
+ * kept as it is by all of clip_polygon_against_plane(). With guard band
+ * clipping, a point outside a side plane also gets the bit of the guard band
+ * plane beyond it if it is outside that one too
+ */
+int compute_outcode(vec3_t point) {
+  int outcode = 0;
+  for (int plane = 0; plane < NUM_PLANES; plane++) {
+    if (is_outside_plane(point, plane)) {
+      outcode |= 1 << plane;
+    }
+  }
+  if (clipping_mode == CLIP_GUARD_BAND && (outcode & SIDE_PLANES) != 0) {
+    for (int side = 0; side < NUM_GUARD_BAND_PLANES; side++) {
+      if ((outcode & (1 << side)) != 0 &&
+          is_outside_plane(point, LEFT_GUARD_BAND_PLANE + side)) {
+        outcode |= 1 << (LEFT_GUARD_BAND_PLANE + side);
+      }
+    }
   }
-  polygon->num_vertices = num_inside_vertices;
+  return outcode;
 }
 
+/**
+ * The planes a face has to be clipped against, given the OR of the outcodes
+ * of its vertices. Frustum clipping takes every plane some vertex is outside
+ * of. Guard band clipping only takes the near and far planes, and a guard
+ * band plane when a vertex is so far off screen that the rasterizer couldn't
+ * handle it; a face that merely hangs over the window edges stays one
+ * triangle and the rasterizer drops the pixels outside the window
+ */
+int outcode_clip_planes(int outcode) {
+  if (clipping_mode == CLIP_GUARD_BAND) {
+    return outcode & ~SIDE_PLANES;
+  }
+  return outcode;
+}
+
+/**
+ * Classify a camera space sphere against the frustum: outside when it is
+ * entirely behind one of the planes, inside when it is entirely in front of
+ * all of them
+ */
+int classify_sphere_in_frustum(vec3_t center, float radius) {
+  int result = FRUSTUM_INSIDE;
+  for (int plane = 0; plane < NUM_PLANES; plane++) {
+    float distance = vec3_dot(vec3_sub(center, frustum_planes[plane].point),
+                              frustum_planes[plane].normal);
+    if (distance < -radius) {
+      return FRUSTUM_OUTSIDE;
+    }
+    if (distance <= radius) {
+      result = FRUSTUM_INTERSECTING;
+    }
+  }
+  return result;
+}
+
+/**
+ * Classify the convex hull of a set of camera space points (such as the
+ * corners of a bounding box) against the frustum: outside when all points are
+ * behind the same plane, inside when every point is strictly inside all of
+ * them, so nothing within the hull needs clipping
+ */
+int classify_points_in_frustum(const vec3_t points[], int num_points) {
+  int result = FRUSTUM_INSIDE;
+  for (int plane = 0; plane < NUM_PLANES; plane++) {
+    int num_behind = 0;
+    int num_in_front = 0;
+    for (int i = 0; i < num_points; i++) {
+      float distance =
+          vec3_dot(vec3_sub(points[i], frustum_planes[plane].point),
+                   frustum_planes[plane].normal);
+      if (distance < 0) {
+        num_behind++;
+      } else if (distance > 0) {
+        num_in_front++;
+      }
+    }
+    if (num_behind == num_points) {
+      return FRUSTUM_OUTSIDE;
+    }
+    if (num_in_front < num_points) {
+      result = FRUSTUM_INTERSECTING;
+    }
+  }
+  return result;
+}
+
+/**
+ * Express the frustum planes in the object space of a mesh, as plane
+ * equations: a point p is inside a plane when
+ * plane.x * p.x + plane.y * p.y + plane.z * p.z + plane.w > 0. A camera space
+ * plane with normal n through point q holds the object space points p with
+ * dot(n, M p + t - q) > 0, for the upper 3x3 M and translation t of the
+ * model-view matrix, so its object space normal is the transpose of M times n
+ */
+void transform_frustum_planes(const mat4_t *model_view_matrix,
+                              vec4_t planes[]) {
+  const float(*m)[4] = model_view_matrix->m;
+  for (int plane = 0; plane < NUM_PLANES; plane++) {
+    vec3_t n = frustum_planes[plane].normal;
+    vec3_t offset = {m[0][3] - frustum_planes[plane].point.x,
+                     m[1][3] - frustum_planes[plane].point.y,
+                     m[2][3] - frustum_planes[plane].point.z};
+    planes[plane].x = m[0][0] * n.x + m[1][0] * n.y + m[2][0] * n.z;
+    planes[plane].y = m[0][1] * n.x + m[1][1] * n.y + m[2][1] * n.z;
+    planes[plane].z = m[0][2] * n.x + m[1][2] * n.y + m[2][2] * n.z;
+    planes[plane].w = vec3_dot(n, offset);
+  }
+}
+
+/**
+ * Classify an axis aligned box against frustum planes given as plane
+ * equations (see transform_frustum_planes()), the same way
+ * classify_points_in_frustum() classifies its corners. Only the corner
+ * farthest along the normal of a plane and the one farthest against it need
+ * testing, and both follow from the center and half size of the box
+ */
+int classify_box_in_planes(const vec4_t planes[], vec3_t min, vec3_t max) {
+  vec3_t center = vec3_mul(vec3_add(min, max), 0.5);
+  vec3_t half_size = vec3_mul(vec3_sub(max, min), 0.5);
+  int result = FRUSTUM_INSIDE;
+  for (int plane = 0; plane < NUM_PLANES; plane++) {
+    vec4_t p = planes[plane];
+    float distance = p.x * center.x + p.y * center.y + p.z * center.z + p.w;
+    float reach = fabsf(p.x) * half_size.x + fabsf(p.y) * half_size.y +
+                  fabsf(p.z) * half_size.z;
+    if (distance + reach < 0) {
+      return FRUSTUM_OUTSIDE;
+    }
+    if (distance - reach <= 0) {
+      result = FRUSTUM_INTERSECTING;
+    }
+  }
+  return result;
+}
+
+/**
+ * Clip a polygon against only the frustum planes set in planes (bits as in an
+ * outcode). The polygon is passed back and forth between two buffers instead
+ * of being copied back after every plane
+ */
+void clip_polygon_against_planes(polygon_t *polygon, int planes) {
+  polygon_t buffer;
+  polygon_t *source = polygon;
+  polygon_t *result = &buffer;
+  for (int plane = 0; plane < NUM_PLANES + NUM_GUARD_BAND_PLANES; plane++) {
+    if ((planes & (1 << plane)) == 0) {
+      continue;
+    }
+    clip_polygon_into(source, result, plane);
+    polygon_t *swap = source;
+    source = result;
+    result = swap;
+    if (source->num_vertices == 0) {
+      break;
+    }
+  }
+  if (source != polygon) {
+    *polygon = *source;
+  }
+}
+
+/**
+ * Clip a polygon against the frustum. The outcodes of its vertices decide the
+ * work: a polygon inside all planes is left alone, one with all its vertices
+ * outside the same plane is emptied, and otherwise it is only clipped against
+ * the planes outcode_clip_planes() picks. Planes all vertices are inside of
+ * would give the polygon back unchanged anyway
+ */
 void clip_polygon(polygon_t *polygon) {
-  clip_polygon_against_plane(polygon, LEFT_FRUSTUM_PLANE);
-  clip_polygon_against_plane(polygon, RIGHT_FRUSTUM_PLANE);
-  clip_polygon_against_plane(polygon, TOP_FRUSTUM_PLANE);
-  clip_polygon_against_plane(polygon, BOTTOM_FRUSTUM_PLANE);
-  clip_polygon_against_plane(polygon, NEAR_FRUSTUM_PLANE);
-  clip_polygon_against_plane(polygon, FAR_FRUSTUM_PLANE);
+  int outcode_or = 0;
+  int outcode_and = ~0;
+  for (int i = 0; i < polygon->num_vertices; i++) {
+    int outcode = compute_outcode(polygon->vertices[i]);
+    outcode_or |= outcode;
+    outcode_and &= outcode;
+  }
+  if (outcode_and != 0) {
+    polygon->num_vertices = 0;
+    return;
+  }
+  int planes = outcode_clip_planes(outcode_or);
+  if (planes != 0) {
+    clip_polygon_against_planes(polygon, planes);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Clipping in homogeneous clip space
+///////////////////////////////////////////////////////////////////////////////
+// After the projection matrix the frustum is the box -w <= x <= w and
+// -w <= y <= w, and since our projection maps z_near to 0 and z_far to w,
+// 0 <= z <= w. Every plane is then just a sum or difference of two
+// coordinates, with no plane point or normal to go through, and a vertex
+// made by clipping an edge is already in clip space, ready for the
+// perspective divide. The guard band is the same box GUARD_BAND_SCALE times
+// wider and taller.
+///////////////////////////////////////////////////////////////////////////////
+void set_clipping_space(int space) { clipping_space = space; }
+
+bool is_clipping_homogeneous(void) {
+  return clipping_space == CLIP_HOMOGENEOUS;
+}
+
+// Signed distance of a clip space point to a plane, positive inside of it
+static float clip_space_distance(vec4_t point, int plane) {
+  switch (plane) {
+  case LEFT_FRUSTUM_PLANE:
+    return point.w + point.x;
+  case RIGHT_FRUSTUM_PLANE:
+    return point.w - point.x;
+  case TOP_FRUSTUM_PLANE:
+    return point.w - point.y;
+  case BOTTOM_FRUSTUM_PLANE:
+    return point.w + point.y;
+  case NEAR_FRUSTUM_PLANE:
+    return point.z;
+  case FAR_FRUSTUM_PLANE:
+    return point.w - point.z;
+  case LEFT_GUARD_BAND_PLANE:
+    return point.w * GUARD_BAND_SCALE + point.x;
+  case RIGHT_GUARD_BAND_PLANE:
+    return point.w * GUARD_BAND_SCALE - point.x;
+  case TOP_GUARD_BAND_PLANE:
+    return point.w * GUARD_BAND_SCALE - point.y;
+  default:
+    return point.w * GUARD_BAND_SCALE + point.y;
+  }
+}
+
+/**
+ * Outcode of a clip space point, with the same bits as compute_outcode()
+ */
+int compute_clip_space_outcode(vec4_t point) {
+  int outcode = 0;
+  for (int plane = 0; plane < NUM_PLANES; plane++) {
+    if (clip_space_distance(point, plane) <= 0) {
+      outcode |= 1 << plane;
+    }
+  }
+  if (clipping_mode == CLIP_GUARD_BAND && (outcode & SIDE_PLANES) != 0) {
+    for (int side = 0; side < NUM_GUARD_BAND_PLANES; side++) {
+      if ((outcode & (1 << side)) != 0 &&
+          clip_space_distance(point, LEFT_GUARD_BAND_PLANE + side) <= 0) {
+        outcode |= 1 << (LEFT_GUARD_BAND_PLANE + side);
+      }
+    }
+  }
+  return outcode;
+}
+
+// Clip source against one plane into result, which must be another polygon
+static void clip_homogeneous_polygon_into(const homogeneous_polygon_t *source,
+                                          homogeneous_polygon_t *result,
+                                          int plane) {
+  int num_inside_vertices = 0;
+  if (source->num_vertices == 0) {
+    result->num_vertices = 0;
+    return;
+  }
+
+  int previous = source->num_vertices - 1;
+  float previous_distance =
+      clip_space_distance(source->vertices[previous], plane);
+  for (int current = 0; current < source->num_vertices; current++) {
+    float current_distance =
+        clip_space_distance(source->vertices[current], plane);
+
+    // The edge crosses the plane: add the point where it does
+    if (current_distance * previous_distance < 0) {
+      const vec4_t *a = &source->vertices[previous];
+      const vec4_t *b = &source->vertices[current];
+      const tex2_t *a_uv = &source->texcoords[previous];
+      const tex2_t *b_uv = &source->texcoords[current];
+      float t = previous_distance / (previous_distance - current_distance);
+      result->vertices[num_inside_vertices] =
+          (vec4_t){float_lerp(a->x, b->x, t), float_lerp(a->y, b->y, t),
+                   float_lerp(a->z, b->z, t), float_lerp(a->w, b->w, t)};
+      result->texcoords[num_inside_vertices] = (tex2_t){
+          float_lerp(a_uv->u, b_uv->u, t), float_lerp(a_uv->v, b_uv->v, t)};
+      num_inside_vertices++;
+    }
+
+    if (current_distance > 0) {
+      result->vertices[num_inside_vertices] = source->vertices[current];
+      result->texcoords[num_inside_vertices] = source->texcoords[current];
+      num_inside_vertices++;
+    }
+
+    previous = current;
+    previous_distance = current_distance;
+  }
+  result->num_vertices = num_inside_vertices;
+}
+
+/**
+ * Clip a clip space polygon against only the planes set in planes, passing
+ * it back and forth between two buffers like clip_polygon_against_planes()
+ */
+void clip_homogeneous_polygon_against_planes(homogeneous_polygon_t *polygon,
+                                             int planes) {
+  homogeneous_polygon_t buffer;
+  homogeneous_polygon_t *source = polygon;
+  homogeneous_polygon_t *result = &buffer;
+  for (int plane = 0; plane < NUM_PLANES + NUM_GUARD_BAND_PLANES; plane++) {
+    if ((planes & (1 << plane)) == 0) {
+      continue;
+    }
+    clip_homogeneous_polygon_into(source, result, plane);
+    homogeneous_polygon_t *swap = source;
+    source = result;
+    result = swap;
+    if (source->num_vertices == 0) {
+      break;
+    }
+  }
+  if (source != polygon) {
+    *polygon = *source;
+  }
+}
+
+void triangles_from_homogeneous_polygon(const homogeneous_polygon_t *polygon,
+                                        triangle_t triangles[],
+                                        int *num_triangles) {
+  for (int i = 0; i < polygon->num_vertices - 2; i++) {
+    int indices[3] = {0, i + 1, i + 2};
+    for (int j = 0; j < 3; j++) {
+      triangles[i].points[j] = polygon->vertices[indices[j]];
+      triangles[i].texcoords[j] = polygon->texcoords[indices[j]];
+    }
+  }
+  *num_triangles = polygon->num_vertices - 2;
 }
@@ -1,10 +1,13 @@
 #ifndef CLIPPING_H
 #define CLIPPING_H
 
+#include "matrix.h"
 #include "triangle.h"
 #include "vector.h"
+#include <stdbool.h>
 
 #define MAX_POLY_VERTICES 10
+#define NUM_FRUSTUM_PLANES 6
 #define MAX_POLY_TRIANGLES 10
 
 enum {
@@ -13,9 +16,19 @@ enum {
   TOP_FRUSTUM_PLANE,
   BOTTOM_FRUSTUM_PLANE,
   NEAR_FRUSTUM_PLANE,
-  FAR_FRUSTUM_PLANE
+  FAR_FRUSTUM_PLANE,
+  LEFT_GUARD_BAND_PLANE,
+  RIGHT_GUARD_BAND_PLANE,
+  TOP_GUARD_BAND_PLANE,
+  BOTTOM_GUARD_BAND_PLANE
 };
 
+// How many times wider and taller than the window the guard band is
+#define GUARD_BAND_SCALE 4.0
+
+enum clipping_mode { CLIP_FRUSTUM, CLIP_GUARD_BAND };
+enum clipping_space { CLIP_CAMERA_SPACE, CLIP_HOMOGENEOUS };
+
 typedef struct {
   vec3_t point;
   vec3_t normal;
@@ -27,12 +40,62 @@ typedef struct {
   int num_vertices;
 } polygon_t;
 
+// A polygon in homogeneous clip space, before the perspective divide
+typedef struct {
+  vec4_t vertices[MAX_POLY_VERTICES];
+  tex2_t texcoords[MAX_POLY_VERTICES];
+  int num_vertices;
+} homogeneous_polygon_t;
+
 void init_frustum_planes(float fov_x, float fov_y, float z_near, float z_far);
+
+/**
+ * choose between clipping faces against all six frustum planes and clipping
+ * them only against the near and far planes, leaving the window edges to the
+ * rasterizer as long as the face fits inside the guard band
+ */
+void set_clipping_mode(int mode);
+
+/**
+ * check if guard band clipping is enabled
+ */
+bool is_clipping_guard_band(void);
+
+/**
+ * choose between transforming vertices to camera space and clipping them
+ * against the frustum planes there, and transforming them straight to clip
+ * space with one model-view-projection matrix and clipping them against the
+ * -w <= x, y <= w, 0 <= z <= w box
+ */
+void set_clipping_space(int space);
+
+/**
+ * check if faces are clipped in homogeneous clip space
+ */
+bool is_clipping_homogeneous(void);
 polygon_t create_polygon_from_triangle(vec3_t v0, vec3_t v1, vec3_t v2,
                                        tex2_t t0, tex2_t t1, tex2_t t2);
+// Where a bounding volume is relative to the frustum
+enum { FRUSTUM_OUTSIDE, FRUSTUM_INTERSECTING, FRUSTUM_INSIDE };
+
+int compute_outcode(vec3_t point);
+int outcode_clip_planes(int outcode);
+int classify_sphere_in_frustum(vec3_t center, float radius);
+int classify_points_in_frustum(const vec3_t points[], int num_points);
+void transform_frustum_planes(const mat4_t *model_view_matrix,
+                              vec4_t planes[]);
+int classify_box_in_planes(const vec4_t planes[], vec3_t min, vec3_t max);
 void clip_polygon(polygon_t *polygon);
 void clip_polygon_against_plane(polygon_t *polygon, int plane);
+void clip_polygon_against_planes(polygon_t *polygon, int planes);
 void triangles_from_polygon(polygon_t *polygon, triangle_t triangles[],
                             int *num_triangles);
 
+int compute_clip_space_outcode(vec4_t point);
+void clip_homogeneous_polygon_against_planes(homogeneous_polygon_t *polygon,
+                                             int planes);
+void triangles_from_homogeneous_polygon(const homogeneous_polygon_t *polygon,
+                                        triangle_t triangles[],
+                                        int *num_triangles);
+
 #endif
@@ -1,52 +1,62 @@
 #include "display.h"
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 static SDL_Window *window = NULL;
 static SDL_Renderer *renderer = NULL;
 
+// The color buffer being drawn into, one of NUM_COLOR_BUFFERS, see
+// presentation below
+#define NUM_COLOR_BUFFERS 2
+static uint32_t *color_buffers[NUM_COLOR_BUFFERS] = {NULL};
 static uint32_t *color_buffer = NULL;
 static float *z_buffer = NULL;
 
+// hierarchical z: farthest depth per 8x8 block and per tile of z_buffer
+static float *z_block_buffer = NULL;
+static float *z_tile_buffer = NULL;
+static int z_blocks_x = 0;
+static int z_blocks_y = 0;
+static int z_tiles_x = 0;
+static int z_tiles_y = 0;
+
 static SDL_Texture *color_buffer_texture = NULL;
 static int window_width = 640;
 static int window_height = 480;
 
+// One row of the background grid, without the lines across it. Every frame
+// starts from this pattern, see set_background_grid()
+static uint32_t *grid_row = NULL;
+static uint32_t grid_line_color = 0;
+
 static int render_method = 0;
 static int cull_method = 0;
+static int clear_method = CLEAR_LAZY;
 
 int get_window_width(void) { return window_width; }
 
 int get_window_height(void) { return window_height; }
-/**
- * Initializes an SDL window and the renderer for that window
- *
- * @return  boolean to denote if window opened successfully or not
- */
-bool initialize_window(void) {
-  // Initialize SDL with this argument defined in SDL
-  // which allows us to initialize everything we need (graphics, hardware, etc)
-  if (SDL_Init(SDL_INIT_EVERYTHING) != 0) {
-    fprintf(stderr, "Error initializing SDL.\n");
-    return false;
-  }
-
-  // Use SDL to query what the fullscreen dimensions are
-  SDL_DisplayMode display_mode;
-  SDL_GetCurrentDisplayMode(0, &display_mode);
-  int fullscreen_width = display_mode.w;
-  int fullscreen_height = display_mode.h;
-
-  // If desired, you can create a 'pixelation factor' var and divide width and
-  // height by it
-
-  // Create an SDL Window
-  // args: window title, top left x/y pos, size, custom flags
-  window = SDL_CreateWindow(NULL, 0, 0, fullscreen_width, fullscreen_height,
-                            SDL_WINDOW_BORDERLESS);
-  if (!window) {
-    fprintf(stderr, "Error creating SDL window.\n");
-    return false;
-  }
 
+///////////////////////////////////////////////////////////////////////////////
+// Presentation
+///////////////////////////////////////////////////////////////////////////////
+// SDL only lets the thread that owns the window use its renderer, so frames
+// are uploaded and presented from the main thread, but a frame later. One
+// color buffer is drawn into while the other holds the frame finished before,
+// and render_color_buffer() just trades them. The main thread presents the
+// finished one with present_color_buffer() while the worker threads draw the
+// tiles of the next frame, so neither the upload nor waiting for the display
+// to refresh holds up drawing.
+///////////////////////////////////////////////////////////////////////////////
+
+static uint32_t *finished_buffer = NULL;
+static bool is_finished_presented = true;
+
+static bool create_renderer(void) {
   // Create an SDL renderer
   // args: ptr to window it belongs to, display device (-1 = default graphics
   // driver), custom flags
@@ -56,13 +66,6 @@ bool initialize_window(void) {
     return false;
   }
 
-  // allocate the required memory for the color buffer
-  color_buffer =
-      (uint32_t *)malloc(sizeof(uint32_t) * window_width * window_height);
-
-  // allocate the required memory for the depth buffer
-  z_buffer = (float *)malloc(sizeof(float) * window_width * window_height);
-
   // Create SDL texture that is used to display the color buffer
   // Remember, the color buffer is just a data structure that holds the pixel
   // values, while the texture is the actual thing that will be displayed, so we
@@ -75,21 +78,28 @@ bool initialize_window(void) {
       window_width, // width of the actual texture (not always window width)
       window_height // height of actual texture (not always window height)
   );
-
   return true;
 }
 
-/**
- * Get the color buffer in memory and copy all of those pixel's values to
- * the texture so they can be displayed
- */
-void render_color_buffer(void) {
-  // copy all pixel values in color_buffer to color_buffer_texture
+static void destroy_renderer(void) {
+  SDL_DestroyTexture(color_buffer_texture);
+  color_buffer_texture = NULL;
+  SDL_DestroyRenderer(renderer);
+  renderer = NULL;
+}
+
+void present_color_buffer(void) {
+  if (is_finished_presented) {
+    return;
+  }
+  is_finished_presented = true;
+
+  // copy all pixel values in the color buffer to color_buffer_texture
   SDL_UpdateTexture(
       color_buffer_texture, // the texture to be updated
       NULL, // used if we only want subsection of texture, we want the entire
             // thing in this case
-      color_buffer, // source to copy to texture
+      finished_buffer, // source to copy to texture
       (int)(window_width *
             sizeof(uint32_t)) // texture pitch (size, in bytes, of each row)
   );
@@ -105,6 +115,70 @@ void render_color_buffer(void) {
   SDL_RenderPresent(renderer);
 }
 
+/**
+ * Initializes an SDL window and the renderer for that window
+ *
+ * @return  boolean to denote if window opened successfully or not
+ */
+bool initialize_window(void) {
+  // Initialize SDL with this argument defined in SDL
+  // which allows us to initialize everything we need (graphics, hardware, etc)
+  if (SDL_Init(SDL_INIT_EVERYTHING) != 0) {
+    fprintf(stderr, "Error initializing SDL.\n");
+    return false;
+  }
+
+  // Use SDL to query what the fullscreen dimensions are
+  SDL_DisplayMode display_mode;
+  SDL_GetCurrentDisplayMode(0, &display_mode);
+  int fullscreen_width = display_mode.w;
+  int fullscreen_height = display_mode.h;
+
+  // If desired, you can create a 'pixelation factor' var and divide width and
+  // height by it
+
+  // Create an SDL Window
+  // args: window title, top left x/y pos, size, custom flags
+  window = SDL_CreateWindow(NULL, 0, 0, fullscreen_width, fullscreen_height,
+                            SDL_WINDOW_BORDERLESS);
+  if (!window) {
+    fprintf(stderr, "Error creating SDL window.\n");
+    return false;
+  }
+
+  // allocate the required memory for the color buffers
+  for (int i = 0; i < NUM_COLOR_BUFFERS; i++) {
+    color_buffers[i] =
+        (uint32_t *)malloc(sizeof(uint32_t) * window_width * window_height);
+  }
+  color_buffer = color_buffers[0];
+  finished_buffer = color_buffers[1];
+
+  // allocate the required memory for the depth buffer
+  z_buffer = (float *)malloc(sizeof(float) * window_width * window_height);
+
+  // allocate the coarse levels of the depth buffer, rounding partial blocks
+  // and tiles at the right and bottom edges of the window up
+  z_blocks_x = (window_width + Z_BLOCK_SIZE - 1) / Z_BLOCK_SIZE;
+  z_blocks_y = (window_height + Z_BLOCK_SIZE - 1) / Z_BLOCK_SIZE;
+  z_tiles_x = (window_width + Z_TILE_SIZE - 1) / Z_TILE_SIZE;
+  z_tiles_y = (window_height + Z_TILE_SIZE - 1) / Z_TILE_SIZE;
+  z_block_buffer = (float *)malloc(sizeof(float) * z_blocks_x * z_blocks_y);
+  z_tile_buffer = (float *)malloc(sizeof(float) * z_tiles_x * z_tiles_y);
+
+  // allocate the background pattern, black until it is set
+  grid_row = (uint32_t *)calloc(window_width, sizeof(uint32_t));
+
+  return create_renderer();
+}
+
+void render_color_buffer(void) {
+  uint32_t *finished = color_buffer;
+  color_buffer = finished_buffer;
+  finished_buffer = finished;
+  is_finished_presented = false;
+}
+
 /**
  * Clear the color buffer (to be called before displaying a new frame)
  *
@@ -123,6 +197,176 @@ void clear_z_buffer(void) {
   for (int i = 0; i < window_width * window_height; i++) {
     z_buffer[i] = 1.0;
   }
+  for (int i = 0; i < z_blocks_x * z_blocks_y; i++) {
+    z_block_buffer[i] = 1.0;
+  }
+  for (int i = 0; i < z_tiles_x * z_tiles_y; i++) {
+    z_tile_buffer[i] = 1.0;
+  }
+}
+
+void set_background_grid(uint32_t line_color, uint32_t fill_color) {
+  grid_line_color = line_color;
+  for (int x = 0; x < window_width; x++) {
+    grid_row[x] = x % 10 == 0 ? line_color : fill_color;
+  }
+}
+
+// Fill a row of the color buffer from a pattern, or with one color when the
+// pattern is NULL, and a row of the depth buffer with the far plane if depth
+// is not NULL, 4 aligned pixels at a time. Streaming stores are
+// non-temporal: they send whole cache lines straight to memory instead of
+// reading each one in first only to overwrite it, and leave the cache to what
+// is drawn next
+static void clear_row(uint32_t *color, const uint32_t *pattern, uint32_t fill,
+                      float *depth, int count, bool streaming) {
+  int i = 0;
+#ifdef __SSE2__
+  for (; i < count && ((uintptr_t)&color[i] & 15) != 0; i++) {
+    color[i] = pattern ? pattern[i] : fill;
+  }
+  __m128i fills = _mm_set1_epi32((int)fill);
+  for (; i + 4 <= count; i += 4) {
+    __m128i values =
+        pattern ? _mm_loadu_si128((const __m128i *)&pattern[i]) : fills;
+    if (streaming) {
+      _mm_stream_si128((__m128i *)&color[i], values);
+    } else {
+      _mm_store_si128((__m128i *)&color[i], values);
+    }
+  }
+#endif
+  for (; i < count; i++) {
+    color[i] = pattern ? pattern[i] : fill;
+  }
+
+  if (depth == NULL) {
+    return;
+  }
+  i = 0;
+#ifdef __SSE2__
+  for (; i < count && ((uintptr_t)&depth[i] & 15) != 0; i++) {
+    depth[i] = 1.0;
+  }
+  __m128 far = _mm_set1_ps(1.0);
+  for (; i + 4 <= count; i += 4) {
+    if (streaming) {
+      _mm_stream_ps(&depth[i], far);
+    } else {
+      _mm_store_ps(&depth[i], far);
+    }
+  }
+#endif
+  for (; i < count; i++) {
+    depth[i] = 1.0;
+  }
+}
+
+void clear_frame(void) {
+  // Color and depth row by row in a single sweep, instead of a pass over
+  // each buffer and another one to draw the grid
+  for (int y = 0; y < window_height; y++) {
+    clear_row(&color_buffer[window_width * y], y % 10 == 0 ? NULL : grid_row,
+              grid_line_color, &z_buffer[window_width * y], window_width,
+              true);
+  }
+#ifdef __SSE2__
+  // Non-temporal stores are weakly ordered, so make them visible before any
+  // other thread draws into or presents the buffers
+  _mm_sfence();
+#endif
+  for (int i = 0; i < z_blocks_x * z_blocks_y; i++) {
+    z_block_buffer[i] = 1.0;
+  }
+  for (int i = 0; i < z_tiles_x * z_tiles_y; i++) {
+    z_tile_buffer[i] = 1.0;
+  }
+}
+
+void clear_tile(int tile_x, int tile_y, bool clear_depth) {
+  int x0 = tile_x * Z_TILE_SIZE;
+  int y0 = tile_y * Z_TILE_SIZE;
+  int x1 = x0 + Z_TILE_SIZE < window_width ? x0 + Z_TILE_SIZE : window_width;
+  int y1 = y0 + Z_TILE_SIZE < window_height ? y0 + Z_TILE_SIZE : window_height;
+
+  // Plain stores this time: the tile is drawn into right after, so it had
+  // better be in the cache
+  for (int y = y0; y < y1; y++) {
+    clear_row(&color_buffer[(window_width * y) + x0],
+              y % 10 == 0 ? NULL : &grid_row[x0], grid_line_color,
+              clear_depth ? &z_buffer[(window_width * y) + x0] : NULL,
+              x1 - x0, false);
+  }
+  if (!clear_depth) {
+    return;
+  }
+  for (int block_y = y0 / Z_BLOCK_SIZE; block_y * Z_BLOCK_SIZE < y1;
+       block_y++) {
+    for (int block_x = x0 / Z_BLOCK_SIZE; block_x * Z_BLOCK_SIZE < x1;
+         block_x++) {
+      z_block_buffer[(z_blocks_x * block_y) + block_x] = 1.0;
+    }
+  }
+  z_tile_buffer[(z_tiles_x * tile_y) + tile_x] = 1.0;
+}
+
+float get_z_block_far(int block_x, int block_y) {
+  return z_block_buffer[(z_blocks_x * block_y) + block_x];
+}
+
+float get_z_tile_far(int tile_x, int tile_y) {
+  return z_tile_buffer[(z_tiles_x * tile_y) + tile_x];
+}
+
+// Largest of a width x height rectangle of values, rows stride floats apart.
+// Both levels of the hierarchy reduce an 8x8 rectangle (of pixels or of
+// blocks), which SSE does in two vector maxes per row
+static float farthest_in_rect(const float *values, int stride, int width,
+                              int height) {
+  float farthest = 0;
+#ifdef __SSE__
+  if (width == 8) {
+    __m128 left = _mm_setzero_ps();
+    __m128 right = _mm_setzero_ps();
+    for (int y = 0; y < height; y++) {
+      left = _mm_max_ps(left, _mm_loadu_ps(&values[stride * y]));
+      right = _mm_max_ps(right, _mm_loadu_ps(&values[stride * y + 4]));
+    }
+    __m128 lanes = _mm_max_ps(left, right);
+    lanes = _mm_max_ps(lanes, _mm_movehl_ps(lanes, lanes));
+    lanes = _mm_max_ss(lanes, _mm_shuffle_ps(lanes, lanes, 1));
+    return _mm_cvtss_f32(lanes);
+  }
+#endif
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      float value = values[(stride * y) + x];
+      farthest = value > farthest ? value : farthest;
+    }
+  }
+  return farthest;
+}
+
+void update_z_block(int block_x, int block_y) {
+  int x0 = block_x * Z_BLOCK_SIZE;
+  int y0 = block_y * Z_BLOCK_SIZE;
+  int x1 = x0 + Z_BLOCK_SIZE < window_width ? x0 + Z_BLOCK_SIZE : window_width;
+  int y1 = y0 + Z_BLOCK_SIZE < window_height ? y0 + Z_BLOCK_SIZE : window_height;
+
+  z_block_buffer[(z_blocks_x * block_y) + block_x] = farthest_in_rect(
+      &z_buffer[(window_width * y0) + x0], window_width, x1 - x0, y1 - y0);
+}
+
+void update_z_tile(int tile_x, int tile_y) {
+  int x0 = tile_x * Z_BLOCKS_PER_TILE;
+  int y0 = tile_y * Z_BLOCKS_PER_TILE;
+  int x1 = x0 + Z_BLOCKS_PER_TILE < z_blocks_x ? x0 + Z_BLOCKS_PER_TILE
+                                                : z_blocks_x;
+  int y1 = y0 + Z_BLOCKS_PER_TILE < z_blocks_y ? y0 + Z_BLOCKS_PER_TILE
+                                                : z_blocks_y;
+
+  z_tile_buffer[(z_tiles_x * tile_y) + tile_x] = farthest_in_rect(
+      &z_block_buffer[(z_blocks_x * y0) + x0], z_blocks_x, x1 - x0, y1 - y0);
 }
 
 float get_zbuffer_at(int x, int y) {
@@ -139,8 +383,22 @@ void set_zbuffer_at(int x, int y, float value) {
     return;
   }
   z_buffer[(window_width * y) + x] = value;
+
+  // the coarse levels must never be nearer than any pixel they cover
+  float *block_far = &z_block_buffer[(z_blocks_x * (y / Z_BLOCK_SIZE)) +
+                                     (x / Z_BLOCK_SIZE)];
+  float *tile_far =
+      &z_tile_buffer[(z_tiles_x * (y / Z_TILE_SIZE)) + (x / Z_TILE_SIZE)];
+  if (value > *block_far)
+    *block_far = value;
+  if (value > *tile_far)
+    *tile_far = value;
 }
 
+uint32_t *get_color_buffer(void) { return color_buffer; }
+
+float *get_z_buffer(void) { return z_buffer; }
+
 /**
  *
  */
@@ -244,6 +502,16 @@ void set_cull_method(int method) { cull_method = method; }
  */
 bool is_cull_backface(void) { return cull_method == CULL_BACKFACE; }
 
+/**
+ * set whether frames are cleared all at once or tile by tile
+ */
+void set_clear_method(int method) { clear_method = method; }
+
+/**
+ * check if tiles are cleared by the thread that draws them
+ */
+bool is_clear_lazy(void) { return clear_method == CLEAR_LAZY; }
+
 bool should_render_filled_triangles(void) {
   return (render_method == RENDER_FILL_TRIANGLE ||
           render_method == RENDER_FILL_TRIANGLE_WIRE);
@@ -251,13 +519,24 @@ bool should_render_filled_triangles(void) {
 
 bool should_render_textured_triangles(void) {
   return (render_method == RENDER_TEXTURED ||
-          render_method == RENDER_TEXTURED_WIRE);
+          render_method == RENDER_TEXTURED_WIRE ||
+          render_method == RENDER_TEXTURED_DEFERRED ||
+          render_method == RENDER_TEXTURED_DEFERRED_WIRE);
+}
+
+/**
+ * check if texturing is deferred until visibility is known
+ */
+bool should_render_deferred(void) {
+  return (render_method == RENDER_TEXTURED_DEFERRED ||
+          render_method == RENDER_TEXTURED_DEFERRED_WIRE);
 }
 
 bool should_render_wireframe(void) {
   return (render_method == RENDER_WIRE || render_method == RENDER_WIRE_VERTEX ||
           render_method == RENDER_FILL_TRIANGLE_WIRE ||
-          render_method == RENDER_TEXTURED_WIRE);
+          render_method == RENDER_TEXTURED_WIRE ||
+          render_method == RENDER_TEXTURED_DEFERRED_WIRE);
 }
 
 bool should_render_wire_vertex(void) {
@@ -334,9 +613,14 @@ void draw_line(int x0, int y0, int x1, int y1, uint32_t color) {
 }
 
 void destroy_window(void) {
-  free(color_buffer);
+  destroy_renderer();
+  for (int i = 0; i < NUM_COLOR_BUFFERS; i++) {
+    free(color_buffers[i]);
+  }
   free(z_buffer);
-  SDL_DestroyRenderer(renderer);
+  free(z_block_buffer);
+  free(z_tile_buffer);
+  free(grid_row);
   SDL_DestroyWindow(window);
   SDL_Quit();
 }
@@ -8,15 +8,27 @@
 #define FPS 120
 #define FRAME_TARGET_TIME (1000 / FPS)
 
+// The depth buffer keeps a coarse copy of itself for hierarchical z: the
+// farthest depth of every Z_BLOCK_SIZE square block of pixels and of every
+// Z_TILE_SIZE square tile. A triangle whose nearest depth is not in front of
+// a block's (or tile's) farthest depth can't draw a single pixel there
+#define Z_BLOCK_SIZE 8
+#define Z_TILE_SIZE 64
+#define Z_BLOCKS_PER_TILE (Z_TILE_SIZE / Z_BLOCK_SIZE)
+
 enum cull_method { CULL_NONE, CULL_BACKFACE };
 
+enum clear_method { CLEAR_FULL, CLEAR_LAZY };
+
 enum render_method {
   RENDER_WIRE,
   RENDER_WIRE_VERTEX,
   RENDER_FILL_TRIANGLE,
   RENDER_FILL_TRIANGLE_WIRE,
   RENDER_TEXTURED,
-  RENDER_TEXTURED_WIRE
+  RENDER_TEXTURED_WIRE,
+  RENDER_TEXTURED_DEFERRED,
+  RENDER_TEXTURED_DEFERRED_WIRE
 };
 
 /**
@@ -40,6 +52,19 @@ void set_cull_method(int method);
  */
 bool is_cull_backface(void);
 
+/**
+ * set whether frames are cleared all at once before anything is drawn, or
+ * tile by tile by the thread that rasterizes the tile, right before it draws
+ * into it. Lazily, the depth of tiles nothing is drawn into is not cleared at
+ * all, since nothing reads it either
+ */
+void set_clear_method(int method);
+
+/**
+ * check if tiles are cleared by the thread that draws them
+ */
+bool is_clear_lazy(void);
+
 /**
  * Initialize SDL, initialize/configure the window we will be using
  * and initialize the renderer for that window
@@ -49,11 +74,20 @@ bool is_cull_backface(void);
 bool initialize_window(void);
 
 /**
- * Get the color buffer in memory and copy all of those pixel's values to
- * the texture so they can be displayed
+ * Finish the frame in the color buffer, to be shown by the next
+ * present_color_buffer(), and go on with the other buffer. Never waits for the
+ * display. The buffer drawn into next holds an older frame, so it must be
+ * cleared before drawing
  */
 void render_color_buffer(void);
 
+/**
+ * Copy all pixel values of the frame finished last to the texture and display
+ * it, unless that is done already. Uses the renderer, so only call it from the
+ * thread that initialized the window
+ */
+void present_color_buffer(void);
+
 /**
  * Clear the color buffer (to be called before displaying a new frame)
  *
@@ -63,9 +97,56 @@ void clear_color_buffer(uint32_t color);
 
 void clear_z_buffer(void);
 
+/**
+ * Set the background grid every frame starts from: a line every 10 pixels
+ * across and down, over a fill color
+ *
+ * @param  line_color: color of the grid lines
+ * @param  fill_color: color between the lines
+ */
+void set_background_grid(uint32_t line_color, uint32_t fill_color);
+
+/**
+ * Clear the whole frame in one sweep over memory: the color buffer to the
+ * background grid, and the depth buffer and its coarse levels to the far
+ * plane. Does the work of clear_color_buffer(), clear_z_buffer() and
+ * draw_grid() together
+ */
+void clear_frame(void);
+
+/**
+ * Clear one tile of the frame like clear_frame() does the whole of it
+ *
+ * @param  tile_x: column of the tile, in Z_TILE_SIZE pixels
+ * @param  tile_y: row of the tile
+ * @param  clear_depth: clear the depth of the tile as well as its color
+ */
+void clear_tile(int tile_x, int tile_y, bool clear_depth);
+
 float get_zbuffer_at(int x, int y);
 void set_zbuffer_at(int x, int y, float value);
 
+/**
+ * Farthest depth stored in an 8x8 block or a tile of the depth buffer
+ */
+float get_z_block_far(int block_x, int block_y);
+float get_z_tile_far(int tile_x, int tile_y);
+
+/**
+ * Recompute the farthest depth of an 8x8 block or a tile after pixels in it
+ * were written through get_z_buffer(). Blocks must be updated before the tile
+ * they are in
+ */
+void update_z_block(int block_x, int block_y);
+void update_z_tile(int tile_x, int tile_y);
+
+/**
+ * Direct access to the color and depth buffers (window_width pixels per row)
+ * for the rasterizer inner loops, which clamp to the window themselves
+ */
+uint32_t *get_color_buffer(void);
+float *get_z_buffer(void);
+
 /**
  *
  */
@@ -107,6 +188,7 @@ void draw_horizon();
 
 bool should_render_filled_triangles(void);
 bool should_render_textured_triangles(void);
+bool should_render_deferred(void);
 bool should_render_wireframe(void);
 bool should_render_wire_vertex(void);
 
@@ -0,0 +1,181 @@
+#include "job.h"
+#include <SDL2/SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Job pool
+///////////////////////////////////////////////////////////////////////////////
+// start_jobs() adds its batch to a list of pending batches and wakes the worker
+// threads, which sleep on a condition variable while there is nothing to do.
+// Jobs are then handed out through an atomic counter per batch: every thread,
+// the caller included once it gets to finish_jobs(), keeps taking the next job
+// index until the batch runs out, so nobody holds a lock while doing actual
+// work. run_jobs() is the two of them back to back.
+//
+// Several threads can run batches at once, like the geometry thread and the
+// main thread of pipelined frames. Their batches are all pending together,
+// and a worker that runs out of jobs in one batch moves on to the next.
+///////////////////////////////////////////////////////////////////////////////
+
+static SDL_Thread **workers = NULL;
+static int num_workers = 0;
+
+// pending batches, oldest first, and everything else below is only read and
+// written while holding pool_lock
+static SDL_mutex *pool_lock = NULL;
+static job_batch_t *pending_batches = NULL;
+static SDL_cond *batch_ready = NULL;
+static SDL_cond *batch_done = NULL;
+static bool quitting = false;
+
+static void run_pending_jobs(job_batch_t *batch) {
+  int job_index;
+  while ((job_index = SDL_AtomicAdd(&batch->next_job, 1)) < batch->num_jobs) {
+    batch->job_fn(batch->data, job_index);
+  }
+}
+
+static bool has_jobs_left(job_batch_t *batch) {
+  return SDL_AtomicGet(&batch->next_job) < batch->num_jobs;
+}
+
+// Take a batch out of the pending list, so no more workers pick it up
+static void remove_pending_batch(job_batch_t *batch) {
+  if (!batch->is_pending) {
+    return;
+  }
+  job_batch_t **link = &pending_batches;
+  while (*link != batch) {
+    link = &(*link)->next;
+  }
+  *link = batch->next;
+  batch->is_pending = false;
+}
+
+static int worker_main(void *unused) {
+  (void)unused;
+  SDL_LockMutex(pool_lock);
+  while (true) {
+    // the oldest batch that still has jobs to hand out
+    job_batch_t *batch = pending_batches;
+    while (batch != NULL && !has_jobs_left(batch)) {
+      batch = batch->next;
+    }
+    if (batch == NULL) {
+      if (quitting) {
+        break;
+      }
+      SDL_CondWait(batch_ready, pool_lock);
+      continue;
+    }
+
+    batch->num_workers++;
+    SDL_UnlockMutex(pool_lock);
+    run_pending_jobs(batch);
+    SDL_LockMutex(pool_lock);
+
+    // All of its jobs are handed out now, and once the ones taken are done
+    // too the thread that runs the batch can return
+    remove_pending_batch(batch);
+    if (--batch->num_workers == 0) {
+      SDL_CondBroadcast(batch_done);
+    }
+  }
+  SDL_UnlockMutex(pool_lock);
+  return 0;
+}
+
+bool init_job_pool(void) {
+  pool_lock = SDL_CreateMutex();
+  batch_ready = SDL_CreateCond();
+  batch_done = SDL_CreateCond();
+  if (!pool_lock || !batch_ready || !batch_done) {
+    fprintf(stderr, "Error creating job pool: %s\n", SDL_GetError());
+    return false;
+  }
+
+  int num_cpus = SDL_GetCPUCount();
+  workers = (SDL_Thread **)malloc(sizeof(SDL_Thread *) * num_cpus);
+  for (int i = 0; i < num_cpus - 1; i++) {
+    workers[num_workers] = SDL_CreateThread(worker_main, "job worker", NULL);
+    if (!workers[num_workers]) {
+      fprintf(stderr, "Error creating job worker: %s\n", SDL_GetError());
+      return false;
+    }
+    num_workers++;
+  }
+  return true;
+}
+
+int get_num_job_threads(void) { return num_workers + 1; }
+
+// Not worth waking anybody up for a single job
+static bool is_worth_sharing(int num_jobs) {
+  return num_jobs > 1 && num_workers > 0;
+}
+
+void start_jobs(job_batch_t *batch, int num_jobs, job_fn_t job_fn,
+                void *data) {
+  batch->job_fn = job_fn;
+  batch->data = data;
+  batch->num_jobs = num_jobs;
+  batch->num_workers = 0;
+  batch->is_pending = is_worth_sharing(num_jobs);
+  batch->next = NULL;
+  SDL_AtomicSet(&batch->next_job, 0);
+  if (!batch->is_pending) {
+    return;
+  }
+
+  SDL_LockMutex(pool_lock);
+  job_batch_t **link = &pending_batches;
+  while (*link != NULL) {
+    link = &(*link)->next;
+  }
+  *link = batch;
+  SDL_CondBroadcast(batch_ready);
+  SDL_UnlockMutex(pool_lock);
+}
+
+void finish_jobs(job_batch_t *batch) {
+  run_pending_jobs(batch);
+  if (!is_worth_sharing(batch->num_jobs)) {
+    return;
+  }
+
+  // The batch is only done once every worker has stopped looking at it
+  SDL_LockMutex(pool_lock);
+  remove_pending_batch(batch);
+  while (batch->num_workers > 0) {
+    SDL_CondWait(batch_done, pool_lock);
+  }
+  SDL_UnlockMutex(pool_lock);
+}
+
+void run_jobs(int num_jobs, job_fn_t job_fn, void *data) {
+  job_batch_t batch;
+  start_jobs(&batch, num_jobs, job_fn, data);
+  finish_jobs(&batch);
+}
+
+void destroy_job_pool(void) {
+  if (pool_lock) {
+    SDL_LockMutex(pool_lock);
+    quitting = true;
+    SDL_CondBroadcast(batch_ready);
+    SDL_UnlockMutex(pool_lock);
+  }
+
+  for (int i = 0; i < num_workers; i++) {
+    SDL_WaitThread(workers[i], NULL);
+  }
+  free(workers);
+  workers = NULL;
+  num_workers = 0;
+
+  SDL_DestroyCond(batch_done);
+  SDL_DestroyCond(batch_ready);
+  SDL_DestroyMutex(pool_lock);
+  pool_lock = NULL;
+}
@@ -0,0 +1,77 @@
+#ifndef JOB_H
+#define JOB_H
+
+#include <SDL2/SDL.h>
+#include <stdbool.h>
+
+// A job function is called once for every job index of a batch, from whichever
+// thread of the pool picks that index up
+typedef void (*job_fn_t)(void *data, int job_index);
+
+typedef struct job_batch job_batch_t;
+
+// A batch of jobs started with start_jobs(). It is not opaque so that it can
+// live on the stack of whoever runs it, and must stay there until
+// finish_jobs() returns
+struct job_batch {
+  job_fn_t job_fn;
+  void *data;
+  int num_jobs;
+  SDL_atomic_t next_job; // next job index to hand out
+  int num_workers;       // workers taking jobs from it, under the pool lock
+  bool is_pending;       // in the list of pending batches
+  job_batch_t *next;     // next pending batch
+};
+
+/**
+ * Start the worker threads of the job pool. Together with the calling thread
+ * there will be one thread per logical CPU
+ *
+ * @return boolean: indicate whether all worker threads were started
+ */
+bool init_job_pool(void);
+
+/**
+ * Number of threads that run jobs, including the thread calling run_jobs()
+ */
+int get_num_job_threads(void);
+
+/**
+ * Run job_fn for every index from 0 to num_jobs - 1 on the job pool and block
+ * until all of them are done. The calling thread runs jobs as well, so this
+ * also works (serially) when no worker threads could be started. Several
+ * threads can run batches at the same time, and the workers share themselves
+ * out over all of them
+ *
+ * @param  num_jobs: number of job indices in this batch
+ * @param  job_fn: function to run for each job index
+ * @param  data: passed through to every job_fn call
+ */
+void run_jobs(int num_jobs, job_fn_t job_fn, void *data);
+
+/**
+ * Start a batch like run_jobs(), but return right away and leave its jobs to
+ * the worker threads, so the calling thread can do something else meanwhile.
+ * finish_jobs() must be called on the batch before anything it uses goes away
+ *
+ * @param  batch: the batch, which must stay valid until finish_jobs() returns
+ * @param  num_jobs: number of job indices in this batch
+ * @param  job_fn: function to run for each job index
+ * @param  data: passed through to every job_fn call
+ */
+void start_jobs(job_batch_t *batch, int num_jobs, job_fn_t job_fn, void *data);
+
+/**
+ * Run the jobs of a batch from start_jobs() that no worker has taken yet on
+ * the calling thread, and block until all of them are done
+ *
+ * @param  batch: the batch passed to start_jobs()
+ */
+void finish_jobs(job_batch_t *batch);
+
+/**
+ * Stop and join all the worker threads
+ */
+void destroy_job_pool(void);
+
+#endif
@@ -1,10 +1,14 @@
+#include "arena.h"
 #include "array.h"
 #include "camera.h"
 #include "clipping.h"
 #include "display.h"
+#include "job.h"
 #include "light.h"
 #include "matrix.h"
 #include "mesh.h"
+#include "raster.h"
+#include "sort.h"
 #include "texture.h"
 #include "triangle.h"
 #include "upng.h"
@@ -13,6 +17,8 @@
 #include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 bool is_running = false;
 int previous_frame_time = 0;
@@ -20,13 +26,27 @@ float delta_time = 0;
 int grid_bg;
 int grid_fg;
 
-// an array of triangles to be rendered frame by frame
-// switched to static array so we don't have to reallocate a dynamic array every
-// frame
-#define MAX_TRIANGLES 10000
-triangle_t triangles_to_render[MAX_TRIANGLES];
+// The triangles of a frame, and everything else update() only needs while it
+// builds them, come from a frame arena that is reset at the start of the next
+// update(). There are two arenas, so the geometry of the next frame can be
+// built while the triangles of this one are rasterized: update() fills
+// triangles_to_update from update_arena, render() draws triangles_to_render,
+// and swap_triangle_buffers() trades them once both are done
+static arena_t frame_arenas[2];
+static arena_t *update_arena = &frame_arenas[0];
+static arena_t *render_arena = &frame_arenas[1];
+triangle_t *triangles_to_update = NULL;
+int num_triangles_to_update = 0;
+triangle_t *triangles_to_render = NULL;
 int num_triangles_to_render = 0;
 
+// Whether update() runs on the geometry thread, one frame ahead of render()
+static bool is_pipelined = false;
+static SDL_Thread *geometry_thread = NULL;
+static SDL_sem *geometry_start = NULL;
+static SDL_sem *geometry_done = NULL;
+static bool geometry_quitting = false;
+
 mat4_t proj_matrix;
 mat4_t view_matrix;
 
@@ -38,6 +58,15 @@ void setup(void) {
   // initialize render mode
   set_render_method(RENDER_TEXTURED);
   set_cull_method(CULL_BACKFACE);
+  set_background_grid(0x00040404, 0x00020000);
+
+  // pick the fastest pixel kernels and vertex transform this CPU supports
+  init_span_kernels();
+  init_matrix_kernels();
+
+  // start the worker threads and the screen tiles they rasterize
+  init_job_pool();
+  init_raster();
 
   // initialize the scene light direction
   init_light(vec3_new(0, 0, 1));
@@ -121,6 +150,53 @@ void process_input(void) {
         set_cull_method(CULL_NONE);
         break;
       }
+      // If 9 is pressed, set render method to textured through the
+      // visibility buffer
+      if (event.key.keysym.sym == SDLK_9) {
+        set_render_method(RENDER_TEXTURED_DEFERRED);
+        break;
+      }
+      // If 0 is pressed, set render method to deferred textured+wire
+      if (event.key.keysym.sym == SDLK_0) {
+        set_render_method(RENDER_TEXTURED_DEFERRED_WIRE);
+        break;
+      }
+      // If g is pressed, toggle between frustum and guard band clipping
+      if (event.key.keysym.sym == SDLK_g) {
+        set_clipping_mode(is_clipping_guard_band() ? CLIP_FRUSTUM
+                                                   : CLIP_GUARD_BAND);
+        break;
+      }
+      // If h is pressed, toggle between clipping in camera space and in
+      // homogeneous clip space
+      if (event.key.keysym.sym == SDLK_h) {
+        set_clipping_space(is_clipping_homogeneous() ? CLIP_CAMERA_SPACE
+                                                     : CLIP_HOMOGENEOUS);
+        break;
+      }
+      // If l is pressed, toggle picking levels of detail by size on screen
+      if (event.key.keysym.sym == SDLK_l) {
+        set_lod_method(is_lod_enabled() ? LOD_NONE : LOD_SCREEN_ERROR);
+        break;
+      }
+      // If p is pressed, toggle building the geometry of the next frame while
+      // the current one is rasterized
+      if (event.key.keysym.sym == SDLK_p) {
+        is_pipelined = !is_pipelined && geometry_thread != NULL;
+        break;
+      }
+      // If c is pressed, toggle clearing every tile of the frame right before
+      // it is rasterized
+      if (event.key.keysym.sym == SDLK_c) {
+        set_clear_method(is_clear_lazy() ? CLEAR_FULL : CLEAR_LAZY);
+        break;
+      }
+      // If f is pressed, toggle front to back sorting of the triangles
+      if (event.key.keysym.sym == SDLK_f) {
+        set_sort_method(is_sort_front_to_back() ? SORT_NONE
+                                                : SORT_FRONT_TO_BACK);
+        break;
+      }
       // up arrow: float upward
       if (event.key.keysym.sym == SDLK_UP) {
         move_camera_y(3.0 * delta_time);
@@ -170,6 +246,456 @@ void process_input(void) {
   }
 }
 
+// Camera or clip space positions of the vertices of the meshes in view, one
+// stream per coordinate as the batched transform writes them. They are
+// allocated from the frame arena
+static float *transformed_x = NULL;
+static float *transformed_y = NULL;
+static float *transformed_z = NULL;
+static float *transformed_w = NULL;
+
+// Runs of faces of the mesh being processed that may be visible
+static face_run_t *face_runs = NULL;
+static int face_runs_capacity = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+// Parallel geometry
+///////////////////////////////////////////////////////////////////////////////
+// update() first works out which meshes are in view, at which level of
+// detail, and which runs of their faces may be visible. It cuts that work into
+// chunks and runs two passes over the job pool:
+//
+//  1. vertices: each job transforms a chunk of the vertices of one mesh, into
+//     the transformed streams at the offset of that mesh.
+//  2. faces: each job culls, clips and lights a chunk of the faces of one
+//     mesh, and appends the resulting triangles to its own bin. The outcodes
+//     and screen positions of the vertices its faces use are only worked out
+//     when a face gets that far, and kept in a small cache of the job's own,
+//     which catches most of the sharing since neighbouring faces are next to
+//     each other in the chunk and use vertices numbered close together.
+//
+// Within a pass every job writes only its own vertices or its own bin, so
+// nothing needs a lock. The bins are then concatenated in job order, which
+// is mesh order and then face order, so the triangle list comes out the same
+// however the jobs were spread over the threads.
+///////////////////////////////////////////////////////////////////////////////
+
+#define VERTICES_PER_JOB 1024
+#define FACES_PER_JOB 256
+
+// mesh_work_t is a mesh in view this frame, as the jobs need it
+typedef struct {
+  mesh_t *mesh;
+  const mesh_lod_t *lod; // level of detail drawn
+  mat4_t vertex_matrix;  // to camera or clip space
+  int first_vertex;      // where its vertices start in the transformed streams
+  bool is_inside;        // entirely inside the frustum
+} mesh_work_t;
+
+// geometry_job_t is a chunk of the vertices or of the faces of a mesh in view.
+// All faces of a chunk with is_inside set are inside the frustum
+typedef struct {
+  int mesh_work; // index into mesh_works
+  int first;
+  int count;
+  bool is_inside;
+} geometry_job_t;
+
+// A vertex a face job worked on, see vertex_cache_t
+typedef struct {
+  int index;          // into the transformed streams, -1 for none
+  int outcode;        // frustum planes it is outside of, see compute_outcode()
+  bool is_classified; // outcode is set
+  bool is_projected;  // projected is set
+  vec4_t projected;   // screen position
+} cached_vertex_t;
+
+// Direct mapped cache of the vertices of one face job, by index
+#define VERTEX_CACHE_SIZE 256
+typedef struct {
+  cached_vertex_t vertices[VERTEX_CACHE_SIZE];
+} vertex_cache_t;
+
+// The entry of a vertex in the cache of a face job, emptied first if it holds
+// another vertex. Vertices of one face may share an entry, so look it up
+// again every time instead of keeping it
+static cached_vertex_t *cache_vertex(vertex_cache_t *cache, int index) {
+  cached_vertex_t *vertex = &cache->vertices[index & (VERTEX_CACHE_SIZE - 1)];
+  if (vertex->index != index) {
+    *vertex = (cached_vertex_t){.index = index};
+  }
+  return vertex;
+}
+
+// Triangles made by one face job, in chunks allocated from the frame arena as
+// the bin fills up
+#define TRIANGLE_CHUNK_SIZE 64
+typedef struct triangle_chunk triangle_chunk_t;
+struct triangle_chunk {
+  triangle_chunk_t *next;
+  int count;
+  triangle_t triangles[TRIANGLE_CHUNK_SIZE];
+};
+typedef struct {
+  triangle_chunk_t *first;
+  triangle_chunk_t *last;
+  int count;
+} triangle_bin_t;
+
+static mesh_work_t *mesh_works = NULL;
+static int mesh_works_capacity = 0;
+static geometry_job_t *vertex_jobs = NULL;
+static int num_vertex_jobs = 0;
+static int vertex_jobs_capacity = 0;
+static geometry_job_t *face_jobs = NULL;
+static int num_face_jobs = 0;
+static int face_jobs_capacity = 0;
+
+// One bin per face job, allocated from the frame arena
+static triangle_bin_t *triangle_bins = NULL;
+
+/**
+ * Take a clip space point to the screen: x and y in pixels and w the camera
+ * space depth that the perspective divide was done with
+ */
+static vec4_t project_clip_vertex(vec4_t projected_point) {
+  // Perform perspective divide
+  if (projected_point.w != 0) {
+    projected_point.x /= projected_point.w;
+    projected_point.y /= projected_point.w;
+    projected_point.z /= projected_point.w;
+  }
+
+  // On-screen y coordinates are processed in the opposite direction in
+  // which they are read in from .obj files, so we will invert y
+  // coordinates here
+  projected_point.y *= -1;
+
+  // scale into view using window dimensions
+  projected_point.x *= (get_window_width() / 2.0);
+  projected_point.y *= (get_window_height() / 2.0);
+
+  // scale and translate the projected points to the middle of screen
+  projected_point.x += (get_window_width() / 2.0);
+  projected_point.y += (get_window_height() / 2.0);
+  return projected_point;
+}
+
+/**
+ * Project a camera space point to the screen, see project_clip_vertex()
+ */
+static vec4_t project_vertex(vec4_t point) {
+  // project the current vertex (multiply it by the projection matrix)
+  return project_clip_vertex(mat4_mul_vec4(proj_matrix, point));
+}
+
+// Largest factor a matrix scales lengths by, the length of the longest of its
+// axes
+static float max_matrix_scale(const mat4_t *matrix) {
+  float scale = 0;
+  for (int column = 0; column < 3; column++) {
+    vec3_t axis = {matrix->m[0][column], matrix->m[1][column],
+                   matrix->m[2][column]};
+    scale = fmaxf(scale, vec3_length(axis));
+  }
+  return scale;
+}
+
+/**
+ * Classify the bounds of a mesh against the frustum, given the matrix that
+ * takes it to camera space. The bounding sphere is tested first since it is
+ * cheap, and only when it straddles a plane are the corners of the bounding
+ * box, which is usually a tighter fit, tested as well
+ */
+static int classify_mesh_in_frustum(const mesh_t *mesh,
+                                    const mat4_t *model_view_matrix) {
+  // The radius grows with the largest scale factor in the matrix
+  float scale = max_matrix_scale(model_view_matrix);
+  vec3_t center = vec3_from_vec4(mat4_mul_vec4(
+      *model_view_matrix, vec4_from_vec3(mesh->sphere_center)));
+  int result = classify_sphere_in_frustum(center, mesh->sphere_radius * scale);
+  if (result != FRUSTUM_INTERSECTING) {
+    return result;
+  }
+
+  vec3_t corners[8];
+  for (int i = 0; i < 8; i++) {
+    vec3_t corner = {(i & 1) ? mesh->aabb_max.x : mesh->aabb_min.x,
+                     (i & 2) ? mesh->aabb_max.y : mesh->aabb_min.y,
+                     (i & 4) ? mesh->aabb_max.z : mesh->aabb_min.z};
+    corners[i] = vec3_from_vec4(
+        mat4_mul_vec4(*model_view_matrix, vec4_from_vec3(corner)));
+  }
+  return classify_points_in_frustum(corners, 8);
+}
+
+/**
+ * Pick the level of detail of a mesh to draw this frame from how big it is on
+ * screen: how many pixels an object space unit covers at the point of its
+ * bounding sphere nearest to the camera
+ */
+static const mesh_lod_t *select_mesh_lod_on_screen(
+    const mesh_t *mesh, const mat4_t *model_view_matrix) {
+  float scale = max_matrix_scale(model_view_matrix);
+  vec3_t center = vec3_from_vec4(mat4_mul_vec4(
+      *model_view_matrix, vec4_from_vec3(mesh->sphere_center)));
+  float depth = center.z - mesh->sphere_radius * scale;
+  float pixels_per_unit = 0;
+  if (depth > 0) {
+    // proj_matrix.m[1][1] is 1 / tan(fov_y / 2), the focal length in units
+    // of half the window height
+    pixels_per_unit =
+        proj_matrix.m[1][1] * (get_window_height() / 2.0) * scale / depth;
+  }
+  return &mesh->lods[select_mesh_lod(mesh, pixels_per_unit)];
+}
+
+// Split a range of vertices or faces of a mesh into jobs of at most per_job
+static void add_geometry_jobs(geometry_job_t **jobs, int *num_jobs,
+                              int *capacity, int mesh_work, int first,
+                              int count, int per_job, bool is_inside) {
+  for (int start = first; start < first + count; start += per_job) {
+    if (*num_jobs == *capacity) {
+      *capacity = *capacity ? *capacity * 2 : 64;
+      *jobs = (geometry_job_t *)realloc(*jobs,
+                                        sizeof(geometry_job_t) * *capacity);
+    }
+    int end = start + per_job < first + count ? start + per_job : first + count;
+    (*jobs)[(*num_jobs)++] = (geometry_job_t){.mesh_work = mesh_work,
+                                              .first = start,
+                                              .count = end - start,
+                                              .is_inside = is_inside};
+  }
+}
+
+// Room at the end of a bin for the triangles clipping makes of one face, so
+// they are clipped right into place. Only the ones actually made are added
+// to the bin, by triangle_bin_add(). NULL if the frame arena could not grow
+static triangle_t *triangle_bin_reserve(triangle_bin_t *bin) {
+  triangle_chunk_t *chunk = bin->last;
+  if (chunk == NULL ||
+      chunk->count > TRIANGLE_CHUNK_SIZE - MAX_POLY_TRIANGLES) {
+    chunk = (triangle_chunk_t *)arena_alloc(update_arena,
+                                            sizeof(triangle_chunk_t));
+    if (chunk == NULL) {
+      return NULL;
+    }
+    chunk->next = NULL;
+    chunk->count = 0;
+    if (bin->last != NULL) {
+      bin->last->next = chunk;
+    } else {
+      bin->first = chunk;
+    }
+    bin->last = chunk;
+  }
+  return &chunk->triangles[chunk->count];
+}
+
+static void triangle_bin_add(triangle_bin_t *bin, int count) {
+  bin->last->count += count;
+  bin->count += count;
+}
+
+// Transform a chunk of the vertices of a mesh once, to camera space or,
+// through a single model-view-projection matrix, straight to clip space.
+// Faces share their vertices, so doing it face by face transformed each of
+// them about three times over
+static void transform_vertices_job(void *data, int job_index) {
+  (void)data;
+  const geometry_job_t *job = &vertex_jobs[job_index];
+  const mesh_work_t *work = &mesh_works[job->mesh_work];
+  const mesh_lod_t *lod = work->lod;
+  int offset = work->first_vertex + job->first;
+  float *x = &transformed_x[offset];
+  float *y = &transformed_y[offset];
+  float *z = &transformed_z[offset];
+  float *w = &transformed_w[offset];
+
+  if (lod->positions_x != NULL) {
+    // the whole chunk at once, 8 or 4 vertices at a time
+    mat4_mul_vec3_streams(&work->vertex_matrix, &lod->positions_x[job->first],
+                          &lod->positions_y[job->first],
+                          &lod->positions_z[job->first], job->count, x, y, z,
+                          w);
+  } else {
+    for (int v = 0; v < job->count; v++) {
+      vec4_t transformed =
+          mat4_mul_vec4(work->vertex_matrix,
+                        vec4_from_vec3(lod->vertices[job->first + v]));
+      x[v] = transformed.x;
+      y[v] = transformed.y;
+      z[v] = transformed.z;
+      w[v] = transformed.w;
+    }
+  }
+}
+
+// Cull, clip and light a chunk of the faces of a mesh into the job's bin
+static void process_faces_job(void *data, int job_index) {
+  (void)data;
+  const geometry_job_t *job = &face_jobs[job_index];
+  const mesh_work_t *work = &mesh_works[job->mesh_work];
+  mesh_t *mesh = work->mesh;
+  const mesh_lod_t *lod = work->lod;
+  const mesh_transform_t *transform = &mesh->transform;
+  bool homogeneous = is_clipping_homogeneous();
+  triangle_bin_t *bin = &triangle_bins[job_index];
+  vertex_cache_t cache;
+  for (int v = 0; v < VERTEX_CACHE_SIZE; v++) {
+    cache.vertices[v].index = -1;
+  }
+
+  // loop all triangle faces of the chunk
+  for (int i = job->first; i < job->first + job->count; i++) {
+    face_t mesh_face = lod->faces[i];
+    face_plane_t plane =
+        lod->face_planes != NULL
+            ? lod->face_planes[i]
+            : compute_face_plane(lod->vertices, &mesh_face);
+
+    // Backface culling (if enabled by user), in object space before any
+    // vertex of the face is looked at: a face is facing away when the
+    // camera is behind its plane. Mirroring flips which side the front is
+    if (is_cull_backface()) {
+      float facing = vec3_dot(plane.normal, transform->camera_position) -
+                     plane.distance;
+      if (transform->is_mirrored ? facing > 0 : facing < 0) {
+        continue;
+      }
+    }
+
+    // gather the transformed vertices of this face by their index, past the
+    // vertices of the meshes before this one
+    int a = work->first_vertex + mesh_face.a - 1;
+    int b = work->first_vertex + mesh_face.b - 1;
+    int c = work->first_vertex + mesh_face.c - 1;
+
+    // label each vertex of this given triangle for the sake of simplicity,
+    // in clip space if clipping is homogeneous and camera space otherwise
+    int face_indices[3] = {a, b, c};
+    vec4_t face_points[3];
+    int outcodes[3] = {0, 0, 0};
+    for (int j = 0; j < 3; j++) {
+      int v = face_indices[j];
+      face_points[j] = (vec4_t){transformed_x[v], transformed_y[v],
+                                transformed_z[v], transformed_w[v]};
+
+      // Vertices of faces in a box entirely inside are inside too
+      if (!job->is_inside) {
+        cached_vertex_t *vertex = cache_vertex(&cache, v);
+        if (!vertex->is_classified) {
+          vertex->outcode =
+              homogeneous ? compute_clip_space_outcode(face_points[j])
+                          : compute_outcode(vec3_from_vec4(face_points[j]));
+          vertex->is_classified = true;
+        }
+        outcodes[j] = vertex->outcode;
+      }
+    }
+
+    // Trivial reject: all three vertices are outside the same frustum
+    // plane, so nothing of the face would survive clipping
+    if ((outcodes[0] & outcodes[1] & outcodes[2]) != 0) {
+      continue;
+    }
+    int clip_planes =
+        outcode_clip_planes(outcodes[0] | outcodes[1] | outcodes[2]);
+
+    // Lighting needs the normal in camera space, which the normal matrix
+    // takes the one of the face plane to
+    vec3_t normal = vec3_from_vec4(mat4_mul_vec4(
+        transform->normal_matrix,
+        (vec4_t){plane.normal.x, plane.normal.y, plane.normal.z, 0}));
+    vec3_normalize(&normal);
+
+    //////////////////
+    // CLIPPING LOGIC:
+    //////////////////
+
+    // The triangles go straight into the bin of this job
+    triangle_t *triangles_after_clipping = triangle_bin_reserve(bin);
+    if (triangles_after_clipping == NULL) {
+      continue;
+    }
+    int num_triangles_after_clipping = 0;
+
+    if (clip_planes == 0) {
+      // Trivial accept: clipping would hand the face back as it is (or the
+      // rasterizer trims it to the window), so skip it and use the
+      // projected vertices this face shares with its neighbours
+      for (int j = 0; j < 3; j++) {
+        cached_vertex_t *vertex = cache_vertex(&cache, face_indices[j]);
+        if (!vertex->is_projected) {
+          vertex->projected = homogeneous
+                                  ? project_clip_vertex(face_points[j])
+                                  : project_vertex(face_points[j]);
+          vertex->is_projected = true;
+        }
+        triangles_after_clipping[0].points[j] = vertex->projected;
+      }
+      triangles_after_clipping[0].texcoords[0] = mesh_face.a_uv;
+      triangles_after_clipping[0].texcoords[1] = mesh_face.b_uv;
+      triangles_after_clipping[0].texcoords[2] = mesh_face.c_uv;
+      num_triangles_after_clipping = 1;
+    } else if (homogeneous) {
+      homogeneous_polygon_t polygon = {
+          .vertices = {face_points[0], face_points[1], face_points[2]},
+          .texcoords = {mesh_face.a_uv, mesh_face.b_uv, mesh_face.c_uv},
+          .num_vertices = 3};
+      clip_homogeneous_polygon_against_planes(&polygon, clip_planes);
+
+      // Divide and map every vertex that survived clipping to the screen
+      // once, before the fan of triangles made from the polygon shares them
+      for (int j = 0; j < polygon.num_vertices; j++) {
+        polygon.vertices[j] = project_clip_vertex(polygon.vertices[j]);
+      }
+      triangles_from_homogeneous_polygon(&polygon, triangles_after_clipping,
+                                         &num_triangles_after_clipping);
+    } else {
+      // Create a polygon from the original transformed triangle to be
+      // clipped
+      polygon_t polygon = create_polygon_from_triangle(
+          vec3_from_vec4(face_points[0]), vec3_from_vec4(face_points[1]),
+          vec3_from_vec4(face_points[2]), mesh_face.a_uv, mesh_face.b_uv,
+          mesh_face.c_uv);
+
+      // Clip the polygon against only the planes it straddles and return a
+      // new polygon with potential new vertices
+      clip_polygon_against_planes(&polygon, clip_planes);
+
+      // Break the clipped polygon apart back into individual triangles
+      triangles_from_polygon(&polygon, triangles_after_clipping,
+                             &num_triangles_after_clipping);
+
+      // The vertices made by clipping belong to this face alone, so project
+      // them right here
+      for (int t = 0; t < num_triangles_after_clipping; t++) {
+        for (int j = 0; j < 3; j++) {
+          triangles_after_clipping[t].points[j] =
+              project_vertex(triangles_after_clipping[t].points[j]);
+        }
+      }
+    }
+
+    // Light and texture all assembled triangles after clipping
+    for (int t = 0; t < num_triangles_after_clipping; t++) {
+      triangle_t *triangle = &triangles_after_clipping[t];
+
+      // Calculate shade intensity based on how aligned the face normal and
+      // light normal are
+      float light_intensity_factor =
+          -vec3_dot(normal, get_light_direction());
+
+      // Calculate triangle color based on light angle
+      triangle->color =
+          light_apply_intensity(mesh_face.color, light_intensity_factor);
+      triangle->texture = &mesh->texture;
+    }
+    triangle_bin_add(bin, num_triangles_after_clipping);
+  }
+}
+
 void update(void) {
   // block program until we have reached the millisecond duration we designated
   // for 1 frame in FRAME_TARGET_TIME (for 30 fps that's 33.333ms) this locks
@@ -193,10 +719,27 @@ void update(void) {
     grid_fg = 0x00000100;
   }
 
-  // Initialize counter of triangles to render for the current frame
-  num_triangles_to_render = 0;
-
-  // Loop all the meshes of our scene
+  // Take back the memory of the frame before last, which render() is done
+  // with, and initialize counter of triangles to render for the current frame
+  arena_reset(update_arena);
+  triangles_to_update = NULL;
+  num_triangles_to_update = 0;
+
+  // Rebuild the view matrix only if the camera moved or turned
+  bool view_changed = update_camera_view_matrix(&view_matrix);
+
+  // Loop all the meshes of our scene, and cut the vertices and the faces
+  // that may be visible of those in view into jobs
+  if (get_num_meshes() > mesh_works_capacity) {
+    mesh_works_capacity = get_num_meshes();
+    mesh_works = (mesh_work_t *)realloc(
+        mesh_works, sizeof(mesh_work_t) * mesh_works_capacity);
+  }
+  bool homogeneous = is_clipping_homogeneous();
+  int num_mesh_works = 0;
+  int num_frame_vertices = 0;
+  num_vertex_jobs = 0;
+  num_face_jobs = 0;
   for (int mesh_index = 0; mesh_index < get_num_meshes(); mesh_index++) {
     mesh_t *mesh = get_mesh(mesh_index);
     // If you want to change mesh scale/rotation values on every frame:
@@ -209,238 +752,221 @@ void update(void) {
     // camera.position.x += 0.008 * delta_time;
     // camera.position.y += 0.008 * delta_time;
 
-    // Create scale, translation and rotation matrices that will be used to
-    // multiply the mesh vertices, passing in the corresponding values (that are
-    // changing over time) in the mesh struct of the corresponding object
-    mat4_t scale_matrix =
-        mat4_make_scale(mesh->scale.x, mesh->scale.y, mesh->scale.z);
-    mat4_t translation_matrix = mat4_make_translation(
-        mesh->translation.x, mesh->translation.y, mesh->translation.z);
-    mat4_t rotation_matrix_x = mat4_make_rotation_x(mesh->rotation.x);
-    mat4_t rotation_matrix_y = mat4_make_rotation_y(mesh->rotation.y);
-    mat4_t rotation_matrix_z = mat4_make_rotation_z(mesh->rotation.z);
-
-    // Update camera look at target to create view matrix
-    vec3_t target = get_camera_lookat_target();
-    vec3_t up_direction = vec3_new(0, 1, 0);
-
-    // Create the view matrix
-    view_matrix = mat4_look_at(get_camera_position(), target, up_direction);
-
-    // loop all triangle faces of our mesh
-    int num_faces = array_length(mesh->faces);
-    for (int i = 0; i < num_faces; i++) {
-      face_t mesh_face = mesh->faces[i];
-
-      vec3_t face_vertices[3];
-      face_vertices[0] = mesh->vertices[mesh_face.a - 1];
-      face_vertices[1] = mesh->vertices[mesh_face.b - 1];
-      face_vertices[2] = mesh->vertices[mesh_face.c - 1];
-
-      vec4_t transformed_vertices[3];
-
-      // loop all 3 vertices of this current face and apply transformations
-      for (int j = 0; j < 3; j++) {
-        vec4_t transformed_vertex = vec4_from_vec3(face_vertices[j]);
-
-        // Create a World Matrix combining scale, rotation and translation
-        // matrices Since matrix multiplication is not commutative, order
-        // matters! (scale, rotate, translate)
-        mat4_t world_matrix = mat4_identity();
-        // multiply w_m by scale to store scale scalars within it
-        world_matrix = mat4_mul_mat4(scale_matrix, world_matrix);
-        // multiply w_m by rotation matrices to store rotation scalars within it
-        world_matrix = mat4_mul_mat4(rotation_matrix_z, world_matrix);
-        world_matrix = mat4_mul_mat4(rotation_matrix_y, world_matrix);
-        world_matrix = mat4_mul_mat4(rotation_matrix_x, world_matrix);
-        // multiply w_m by translation matrix to store translation scalars
-        // within it
-        world_matrix = mat4_mul_mat4(translation_matrix, world_matrix);
-
-        // Multiply world matrix by the original vector to transform scene to
-        // world space
-        transformed_vertex = mat4_mul_vec4(world_matrix, transformed_vertex);
-
-        // Multiply the view matrix by the vector to then transform scene to
-        // camera space
-        transformed_vertex = mat4_mul_vec4(view_matrix, transformed_vertex);
-
-        // Save this transformed vertex (after being scaled/translated/rotated)
-        // in the array of transformed vertices
-        transformed_vertices[j] = transformed_vertex;
-      }
+    // Bring the mesh's world and model-view matrices up to date. They are
+    // only rebuilt when the mesh or the camera actually moved
+    mat4_t model_view_matrix =
+        update_mesh_transform(mesh, view_matrix, view_changed);
+
+    // Test the bounds of the whole mesh against the frustum before any of its
+    // faces: a mesh entirely outside is skipped, and none of the faces of a
+    // mesh entirely inside need clipping
+    int mesh_in_frustum = classify_mesh_in_frustum(mesh, &model_view_matrix);
+    if (mesh_in_frustum == FRUSTUM_OUTSIDE) {
+      continue;
+    }
 
-      // label each vertex of this given triangle for the sake of simplicity
-      vec3_t vector_a = vec3_from_vec4(transformed_vertices[0]);
-      vec3_t vector_b = vec3_from_vec4(transformed_vertices[1]);
-      vec3_t vector_c = vec3_from_vec4(transformed_vertices[2]);
-
-      // culling step 1: find vectors B-A and C-A
-      vec3_t vector_ab = vec3_sub(vector_b, vector_a);
-      vec3_t vector_ac = vec3_sub(vector_c, vector_a);
-      vec3_normalize(&vector_ab);
-      vec3_normalize(&vector_ac);
-
-      // culling step 2: take their cross product and find the perpendicular
-      // normal
-      vec3_t normal = vec3_cross(vector_ab, vector_ac);
-      vec3_normalize(&normal);
-
-      // culling step 3: find the camera ray vector by subtracting camera
-      // position from point A
-      vec3_t origin = {0, 0, 0};
-      vec3_t camera_ray = vec3_sub(origin, vector_a);
-
-      // culling step 4: take dot product between normal and camera ray,
-      // if the dot product is < 0, face is pointing away from camera, do not
-      // display the face
-      float dot_normal_camera = vec3_dot(normal, camera_ray);
-
-      // Backface culling (if enabled by user)
-      if (is_cull_backface()) {
-
-        // if the face normal is pointing away from camera ray...
-        if (dot_normal_camera < 0) {
-          //...bypass the following section that would normally project this
-          //face
-          continue;
-        }
-      }
+    // The vertices go to camera space or, through a single
+    // model-view-projection matrix, straight to clip space
+    mat4_t vertex_matrix =
+        homogeneous ? mat4_mul_mat4(proj_matrix, model_view_matrix)
+                    : model_view_matrix;
+
+    // Only the level of detail the mesh needs at its size on screen is drawn,
+    // so a distant mesh costs as much as the few pixels it covers
+    const mesh_lod_t *lod = select_mesh_lod_on_screen(mesh, &model_view_matrix);
+    mesh_works[num_mesh_works] =
+        (mesh_work_t){.mesh = mesh,
+                      .lod = lod,
+                      .vertex_matrix = vertex_matrix,
+                      .first_vertex = num_frame_vertices,
+                      .is_inside = mesh_in_frustum == FRUSTUM_INSIDE};
+    add_geometry_jobs(&vertex_jobs, &num_vertex_jobs, &vertex_jobs_capacity,
+                      num_mesh_works, 0, lod->num_vertices, VERTICES_PER_JOB,
+                      false);
+    num_frame_vertices += lod->num_vertices;
+
+    // Gather the faces that may be visible as runs. A mesh entirely inside
+    // is one run. Otherwise its hierarchy is walked against the frustum, in
+    // object space, and only the faces of boxes that are not outside are
+    // processed. Faces of boxes entirely inside need no clipping
+    int num_faces = lod->num_faces;
+    int num_runs = 1;
+    int max_runs = lod->num_bvh_nodes > 1 ? lod->num_bvh_nodes : 1;
+    if (max_runs > face_runs_capacity) {
+      face_runs_capacity = max_runs;
+      face_runs = (face_run_t *)realloc(
+          face_runs, sizeof(face_run_t) * face_runs_capacity);
+    }
+    if (mesh_in_frustum == FRUSTUM_INTERSECTING && lod->bvh_nodes != NULL) {
+      vec4_t planes[NUM_FRUSTUM_PLANES];
+      transform_frustum_planes(&model_view_matrix, planes);
+      num_runs = collect_visible_faces(lod->bvh_nodes, planes, face_runs);
+    } else {
+      face_runs[0] = (face_run_t){.first_face = 0,
+                                  .num_faces = num_faces,
+                                  .is_inside =
+                                      mesh_in_frustum == FRUSTUM_INSIDE};
+    }
 
-      //////////////////
-      // CLIPPING LOGIC:
-      //////////////////
+    for (int r = 0; r < num_runs; r++) {
+      add_geometry_jobs(&face_jobs, &num_face_jobs, &face_jobs_capacity,
+                        num_mesh_works, face_runs[r].first_face,
+                        face_runs[r].num_faces, FACES_PER_JOB,
+                        face_runs[r].is_inside);
+    }
+    num_mesh_works++;
+  }
 
-      // Create a polygon from the original transformed triangle to be clipped
-      polygon_t polygon = create_polygon_from_triangle(
-          vec3_from_vec4(transformed_vertices[0]),
-          vec3_from_vec4(transformed_vertices[1]),
-          vec3_from_vec4(transformed_vertices[2]), mesh_face.a_uv,
-          mesh_face.b_uv, mesh_face.c_uv);
+  size_t stream_size = sizeof(float) * num_frame_vertices;
+  transformed_x = (float *)arena_alloc(update_arena, stream_size);
+  transformed_y = (float *)arena_alloc(update_arena, stream_size);
+  transformed_z = (float *)arena_alloc(update_arena, stream_size);
+  transformed_w = (float *)arena_alloc(update_arena, stream_size);
+  triangle_bins = (triangle_bin_t *)arena_alloc(
+      update_arena, sizeof(triangle_bin_t) * num_face_jobs);
+  if (!transformed_x || !transformed_y || !transformed_z || !transformed_w ||
+      !triangle_bins) {
+    return;
+  }
+  memset(triangle_bins, 0, sizeof(triangle_bin_t) * num_face_jobs);
 
-      // Clip the polygon and returns a new polygon with potential new vertices
-      clip_polygon(&polygon);
+  // All the vertices first, since faces of one chunk use vertices of others
+  run_jobs(num_vertex_jobs, transform_vertices_job, NULL);
+  run_jobs(num_face_jobs, process_faces_job, NULL);
 
-      // Break the clipped polygon apart back into individual triangles
-      triangle_t triangles_after_clipping[MAX_POLY_TRIANGLES];
-      int num_triangles_after_clipping = 0;
+  // save the triangles of all bins in the array of triangles to render, in
+  // job order. It is as big as the frame needs
+  int num_triangles = 0;
+  for (int j = 0; j < num_face_jobs; j++) {
+    num_triangles += triangle_bins[j].count;
+  }
+  triangles_to_update = (triangle_t *)arena_alloc(
+      update_arena, sizeof(triangle_t) * num_triangles);
+  if (triangles_to_update == NULL) {
+    return;
+  }
+  for (int j = 0; j < num_face_jobs; j++) {
+    for (const triangle_chunk_t *chunk = triangle_bins[j].first;
+         chunk != NULL; chunk = chunk->next) {
+      memcpy(&triangles_to_update[num_triangles_to_update], chunk->triangles,
+             sizeof(triangle_t) * chunk->count);
+      num_triangles_to_update += chunk->count;
+    }
+  }
 
-      triangles_from_polygon(&polygon, triangles_after_clipping,
-                             &num_triangles_after_clipping);
+  // Draw the nearest triangles first so the depth buffer rejects as much as
+  // possible of what is behind them before it is rasterized
+  if (is_sort_front_to_back()) {
+    sort_triangles_front_to_back(triangles_to_update, num_triangles_to_update);
+  }
+}
 
-      // Loop all assembled triangles after clipping
-      for (int t = 0; t < num_triangles_after_clipping; t++) {
-        triangle_t triangle_after_clipping = triangles_after_clipping[t];
+/**
+ * Hand the triangles update() just built to render(), and the ones render()
+ * is done with back to update()
+ */
+void swap_triangle_buffers(void) {
+  arena_t *arena = render_arena;
+  render_arena = update_arena;
+  update_arena = arena;
+  triangles_to_render = triangles_to_update;
+  num_triangles_to_render = num_triangles_to_update;
+  triangles_to_update = NULL;
+  num_triangles_to_update = 0;
+}
 
-        vec4_t projected_points[3];
+///////////////////////////////////////////////////////////////////////////////
+// Geometry thread
+///////////////////////////////////////////////////////////////////////////////
+// The geometry thread runs update() whenever begin_update() posts to
+// geometry_start, and posts to geometry_done when it is finished. In between
+// the main thread rasterizes the previous frame, so a frame takes about as
+// long as the slower of the two stages instead of both of them in a row.
+// Everything update() reads that input can change (the camera, the meshes,
+// the clipping and culling settings) is only changed by process_input()
+// while the geometry thread is waiting.
+///////////////////////////////////////////////////////////////////////////////
+
+static int geometry_thread_main(void *unused) {
+  (void)unused;
+  while (true) {
+    SDL_SemWait(geometry_start);
+    if (geometry_quitting) {
+      break;
+    }
+    update();
+    SDL_SemPost(geometry_done);
+  }
+  return 0;
+}
 
-        // loop all vertices of triangles NOT excluded by backface culling and
-        // finally project them
-        for (int j = 0; j < 3; j++) {
+/**
+ * Start the geometry thread. Frames stay serial if it could not be started
+ *
+ * @return boolean: indicate whether the thread was started
+ */
+static bool init_geometry_thread(void) {
+  geometry_start = SDL_CreateSemaphore(0);
+  geometry_done = SDL_CreateSemaphore(0);
+  if (geometry_start && geometry_done) {
+    geometry_thread =
+        SDL_CreateThread(geometry_thread_main, "geometry", NULL);
+  }
+  if (!geometry_thread) {
+    fprintf(stderr, "Error creating geometry thread: %s\n", SDL_GetError());
+    return false;
+  }
+  return true;
+}
 
-          // project the current vertex (multiply it by the projection matrix)
-          projected_points[j] =
-              mat4_mul_vec4(proj_matrix, triangle_after_clipping.points[j]);
-
-          // Perform perspective divide
-          if (projected_points[j].w != 0) {
-            projected_points[j].x /= projected_points[j].w;
-            projected_points[j].y /= projected_points[j].w;
-            projected_points[j].z /= projected_points[j].w;
-          }
-
-          // On-screen y coordinates are processed in the opposite direction in
-          // which they are read in from .obj files, so we will invert y
-          // coordinates here
-          projected_points[j].y *= -1;
-
-          // scale into view using window dimensions
-          projected_points[j].x *= (get_window_width() / 2.0);
-          projected_points[j].y *= (get_window_height() / 2.0);
-
-          // scale and translate the projected points to the middle of screen
-          projected_points[j].x += (get_window_width() / 2.0);
-          projected_points[j].y += (get_window_height() / 2.0);
-        }
+// Build the next frame on the geometry thread
+static void begin_update(void) { SDL_SemPost(geometry_start); }
 
-        // Calculate the average depth of each face based on their respective
-        // vertices after transformation
-
-        // Calculate shade intensity based on how aligned the face normal and
-        // light normal are
-        float light_intensity_factor = -vec3_dot(normal, get_light_direction());
-
-        // Calculate triangle color based on light angle
-        uint32_t triangle_color =
-            light_apply_intensity(mesh_face.color, light_intensity_factor);
-
-        // Now using the data we created, we actually create the triangle to
-        // project
-        triangle_t triangle_to_render = {
-            // assign triangle points (taken from the points we just processed
-            // (projected))
-            .points = {{projected_points[0].x, projected_points[0].y,
-                        projected_points[0].z, projected_points[0].w},
-                       {projected_points[1].x, projected_points[1].y,
-                        projected_points[1].z, projected_points[1].w},
-                       {projected_points[2].x, projected_points[2].y,
-                        projected_points[2].z, projected_points[2].w}},
-            /*
-            // AFFINE MAPPING
-            .points = {
-                { projected_points[0].x, projected_points[0].y },
-                { projected_points[1].x, projected_points[1].y },
-                { projected_points[2].x, projected_points[2].y }
-            },*/
-            // assign triangle UV texture coordinates (taken from this object's
-            // mesh's face struct)
-            .texcoords = {{triangle_after_clipping.texcoords[0].u,
-                           triangle_after_clipping.texcoords[0].v},
-                          {triangle_after_clipping.texcoords[1].u,
-                           triangle_after_clipping.texcoords[1].v},
-                          {triangle_after_clipping.texcoords[2].u,
-                           triangle_after_clipping.texcoords[2].v}},
-            // assign this triangle's color
-            .color = triangle_color,
-            .texture = mesh->texture};
-
-        // save the projected triangles in the array of triangles to render
-        if (num_triangles_to_render < MAX_TRIANGLES) {
-          triangles_to_render[num_triangles_to_render++] = triangle_to_render;
-        }
-      }
-    }
+// Block until the geometry thread is done with the frame it was given
+static void finish_update(void) { SDL_SemWait(geometry_done); }
+
+static void destroy_geometry_thread(void) {
+  if (geometry_thread) {
+    geometry_quitting = true;
+    SDL_SemPost(geometry_start);
+    SDL_WaitThread(geometry_thread, NULL);
+    geometry_thread = NULL;
   }
+  SDL_DestroySemaphore(geometry_start);
+  SDL_DestroySemaphore(geometry_done);
+  geometry_start = geometry_done = NULL;
 }
 
-// TODO : Something in this fct is causing slower performance and choppy-looking
-// edges (compare to course code) fix whatever bug is causing this
 void render(void) {
 
-  // Clear all arrays to get ready for next frame
-  clear_color_buffer(0xFF000000);
-  clear_z_buffer();
-
-  draw_grid(0x00040404, 0x00020000);
+  // Clear color and depth to get ready for next frame, all at once unless the
+  // rasterizer clears every tile as it gets to it
+  bool rasterizing =
+      should_render_filled_triangles() || should_render_textured_triangles();
+  if (!rasterizing || !is_clear_lazy()) {
+    clear_frame();
+  }
   // draw_horizon();
 
-  // loop all projected points and render them
+  // if render mode is set to fill, texture or either of them +wireframe, bin
+  // the triangles into screen tiles and rasterize the tiles in parallel
+  if (rasterizing) {
+    begin_rasterize_triangles(triangles_to_render, num_triangles_to_render,
+                              should_render_textured_triangles(),
+                              should_render_deferred());
+  }
+
+  // show the frame before on the window while the worker threads draw the
+  // tiles of this one
+  present_color_buffer();
+  if (rasterizing) {
+    finish_rasterize_triangles();
+  }
+
+  // loop all projected points and draw the overlays on top of them
   for (int i = 0; i < num_triangles_to_render; i++) {
     triangle_t triangle = triangles_to_render[i];
 
-    // if render mode is set to either fill or fill+wireframe...
-    if (should_render_filled_triangles()) {
-      // draw filled triangle
-      draw_filled_triangle(
-          triangle.points[0].x, triangle.points[0].y, triangle.points[0].z,
-          triangle.points[0].w, // vertex A
-          triangle.points[1].x, triangle.points[1].y, triangle.points[1].z,
-          triangle.points[1].w, // vertex B
-          triangle.points[2].x, triangle.points[2].y, triangle.points[2].z,
-          triangle.points[2].w, // vertex C
-          triangle.color);
-    }
-
     // if render mode is set to either wireframe, wireframe+vertices
     // fill+wireframe or textured+fireframe...
     if (should_render_wireframe()) {
@@ -466,22 +992,6 @@ void render(void) {
     }
     */
 
-    // if render mode is set to texture or texture+wireframe...
-    if (should_render_textured_triangles()) {
-      // draw textured triangle
-      draw_textured_triangle(
-          triangle.points[0].x, triangle.points[0].y, triangle.points[0].z,
-          triangle.points[0].w, triangle.texcoords[0].u,
-          triangle.texcoords[0].v, // vertex A
-          triangle.points[1].x, triangle.points[1].y, triangle.points[1].z,
-          triangle.points[1].w, triangle.texcoords[1].u,
-          triangle.texcoords[1].v, // vertex B
-          triangle.points[2].x, triangle.points[2].y, triangle.points[2].z,
-          triangle.points[2].w, triangle.texcoords[2].u,
-          triangle.texcoords[2].v, // vertex C
-          triangle.texture);
-    }
-
     // if render mode is set to wireframe+vertices, render little rectangles at
     // each vertex
     if (should_render_wire_vertex()) {
@@ -494,13 +1004,27 @@ void render(void) {
     }
   }
 
-  // Finally draw the color buffer to the SDL window and actually present the
-  // color buffer
+  // Finally hand the color buffer over to be presented at the next frame
   render_color_buffer();
 }
 
 // free the memory that was dynamically allocated by program
 void free_resources(void) {
+  destroy_geometry_thread();
+  destroy_raster();
+  destroy_sort();
+  free(face_runs);
+  size_t high_water_mark = frame_arenas[0].high_water_mark;
+  if (frame_arenas[1].high_water_mark > high_water_mark) {
+    high_water_mark = frame_arenas[1].high_water_mark;
+  }
+  printf("Frame arena high-water mark: %zu KiB\n", high_water_mark / 1024);
+  arena_free(&frame_arenas[0]);
+  arena_free(&frame_arenas[1]);
+  free(mesh_works);
+  free(vertex_jobs);
+  free(face_jobs);
+  destroy_job_pool();
   free_meshes();
   destroy_window();
 }
@@ -512,14 +1036,28 @@ int main(void) {
   // allocate memory for and create required structures
   setup();
 
-  // our game loop
+  // run the geometry of every frame one frame ahead of its rasterization
+  is_pipelined = init_geometry_thread();
+
+  // our game loop. Input is only handled between frames, while the geometry
+  // thread is idle
   while (is_running) {
     process_input();
-    update();
-    render();
+    if (is_pipelined) {
+      // build the next frame while this one is drawn, so what is drawn is
+      // always the geometry of the frame before
+      begin_update();
+      render();
+      finish_update();
+      swap_triangle_buffers();
+    } else {
+      update();
+      swap_triangle_buffers();
+      render();
+    }
   }
 
-  destroy_window();
+  // joins every thread before the window and SDL go away
   free_resources();
 
   return 0;
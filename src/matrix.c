@@ -1,4 +1,6 @@
 #include "matrix.h"
+#include "matrix_simd.h"
+#include <SDL2/SDL.h>
 #include <math.h>
 
 mat4_t mat4_identity(void) {
@@ -117,6 +119,49 @@ mat4_t mat4_make_perspective(float fov, float aspect_ratio, float znear,
   return result;
 }
 
+mat4_t mat4_make_normal_matrix(mat4_t m) {
+  // Cofactor of every element of the upper 3x3: the determinant of the 2x2
+  // left when its row and column are struck out, with alternating signs. The
+  // rows and columns wrap around, which takes care of the signs
+  mat4_t result = mat4_identity();
+  for (int i = 0; i < 3; i++) {
+    int i1 = (i + 1) % 3;
+    int i2 = (i + 2) % 3;
+    for (int j = 0; j < 3; j++) {
+      int j1 = (j + 1) % 3;
+      int j2 = (j + 2) % 3;
+      result.m[i][j] = m.m[i1][j1] * m.m[i2][j2] - m.m[i1][j2] * m.m[i2][j1];
+    }
+  }
+  return result;
+}
+
+float mat4_determinant3(mat4_t m) {
+  mat4_t cofactor = mat4_make_normal_matrix(m);
+  return m.m[0][0] * cofactor.m[0][0] + m.m[0][1] * cofactor.m[0][1] +
+         m.m[0][2] * cofactor.m[0][2];
+}
+
+vec3_t mat4_inverse_transform_point(mat4_t m, vec3_t point) {
+  // The inverse of the upper 3x3 is its transposed cofactor matrix over its
+  // determinant, applied to the point with the translation taken off
+  mat4_t cofactor = mat4_make_normal_matrix(m);
+  float determinant = mat4_determinant3(m);
+  vec3_t offset = {point.x - m.m[0][3], point.y - m.m[1][3],
+                   point.z - m.m[2][3]};
+  vec3_t result;
+  result.x = (cofactor.m[0][0] * offset.x + cofactor.m[1][0] * offset.y +
+              cofactor.m[2][0] * offset.z) /
+             determinant;
+  result.y = (cofactor.m[0][1] * offset.x + cofactor.m[1][1] * offset.y +
+              cofactor.m[2][1] * offset.z) /
+             determinant;
+  result.z = (cofactor.m[0][2] * offset.x + cofactor.m[1][2] * offset.y +
+              cofactor.m[2][2] * offset.z) /
+             determinant;
+  return result;
+}
+
 vec4_t mat4_mul_vec4_project(mat4_t mat_proj, vec4_t v) {
   // multiply the projection matrix by the original vector
   vec4_t result = mat4_mul_vec4(mat_proj, v);
@@ -155,3 +200,37 @@ mat4_t mat4_look_at(vec3_t eye, vec3_t target, vec3_t up) {
 
   return view_matrix;
 }
+
+typedef int (*stream_kernel_t)(const mat4_t *m, const float *x, const float *y,
+                               const float *z, int count, float *out_x,
+                               float *out_y, float *out_z, float *out_w);
+
+static stream_kernel_t stream_kernel = NULL;
+
+void init_matrix_kernels(void) {
+#if MATRIX_SIMD_X86
+  if (SDL_HasAVX()) {
+    stream_kernel = mat4_mul_vec3_streams_avx;
+  } else if (SDL_HasSSE()) {
+    stream_kernel = mat4_mul_vec3_streams_sse;
+  }
+#endif
+}
+
+void mat4_mul_vec3_streams(const mat4_t *m, const float *x, const float *y,
+                           const float *z, int count, float *out_x,
+                           float *out_y, float *out_z, float *out_w) {
+  int i = 0;
+  if (stream_kernel != NULL) {
+    i = stream_kernel(m, x, y, z, count, out_x, out_y, out_z, out_w);
+  }
+
+  // Points left over after the last whole group, or all of them without SIMD
+  for (; i < count; i++) {
+    vec4_t point = mat4_mul_vec4(*m, (vec4_t){x[i], y[i], z[i], 1});
+    out_x[i] = point.x;
+    out_y[i] = point.y;
+    out_z[i] = point.z;
+    out_w[i] = point.w;
+  }
+}
@@ -22,4 +22,44 @@ mat4_t mat4_make_perspective(float fov, float aspect_ratio, float znear,
                              float zfar);
 
 mat4_t mat4_look_at(vec3_t eye, vec3_t target, vec3_t up);
+
+/**
+ * Matrix that takes the normal of a face through the upper 3x3 of an affine
+ * matrix: its cofactor matrix. A normal that is the cross product of two
+ * edges comes out as the cross product of the transformed edges, scaled by
+ * the determinant, so it stays perpendicular to the face under non-uniform
+ * scaling and flips along with the winding under mirroring
+ */
+mat4_t mat4_make_normal_matrix(mat4_t m);
+
+/**
+ * Take a point back through an affine matrix: the point that m transforms to
+ * the given one
+ */
+vec3_t mat4_inverse_transform_point(mat4_t m, vec3_t point);
+
+/**
+ * Determinant of the upper 3x3 of a matrix, negative when it mirrors
+ */
+float mat4_determinant3(mat4_t m);
+
+/**
+ * Pick the widest stream transform the CPU we are running on supports
+ */
+void init_matrix_kernels(void);
+
+/**
+ * Transform a batch of points, stored as separate streams of x, y and z
+ * coordinates with an implied w of 1, by a matrix. The results are written to
+ * the x, y, z and w output streams, the same values mat4_mul_vec4() gives for
+ * each point. Whole groups of points go through SSE or AVX
+ *
+ * @param  m: matrix to transform by
+ * @param  x, y, z: input coordinate streams of count floats each
+ * @param  count: number of points
+ * @param  out_x, out_y, out_z, out_w: output streams of count floats each
+ */
+void mat4_mul_vec3_streams(const mat4_t *m, const float *x, const float *y,
+                           const float *z, int count, float *out_x,
+                           float *out_y, float *out_z, float *out_w);
 #endif
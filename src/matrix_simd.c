@@ -0,0 +1,67 @@
+#include "matrix_simd.h"
+
+#if MATRIX_SIMD_X86
+#include <immintrin.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// SIMD stream transforms
+///////////////////////////////////////////////////////////////////////////////
+// Each lane holds one vertex, so a row of the matrix is applied to 4 or 8
+// vertices with one multiply per column: out = m0 * x + m1 * y + m2 * z + m3.
+// The products are summed in the same order as mat4_mul_vec4() with w = 1, so
+// the results are exactly the same as transforming the vertices one by one.
+///////////////////////////////////////////////////////////////////////////////
+
+__attribute__((target("sse"))) static __m128
+row_lanes_sse(const mat4_t *m, int row, __m128 x, __m128 y, __m128 z) {
+  __m128 result = _mm_mul_ps(_mm_set1_ps(m->m[row][0]), x);
+  result = _mm_add_ps(result, _mm_mul_ps(_mm_set1_ps(m->m[row][1]), y));
+  result = _mm_add_ps(result, _mm_mul_ps(_mm_set1_ps(m->m[row][2]), z));
+  return _mm_add_ps(result, _mm_set1_ps(m->m[row][3]));
+}
+
+__attribute__((target("sse"))) int
+mat4_mul_vec3_streams_sse(const mat4_t *m, const float *x, const float *y,
+                          const float *z, int count, float *out_x,
+                          float *out_y, float *out_z, float *out_w) {
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128 vx = _mm_loadu_ps(&x[i]);
+    __m128 vy = _mm_loadu_ps(&y[i]);
+    __m128 vz = _mm_loadu_ps(&z[i]);
+    _mm_storeu_ps(&out_x[i], row_lanes_sse(m, 0, vx, vy, vz));
+    _mm_storeu_ps(&out_y[i], row_lanes_sse(m, 1, vx, vy, vz));
+    _mm_storeu_ps(&out_z[i], row_lanes_sse(m, 2, vx, vy, vz));
+    _mm_storeu_ps(&out_w[i], row_lanes_sse(m, 3, vx, vy, vz));
+  }
+  return i;
+}
+
+__attribute__((target("avx"))) static __m256
+row_lanes_avx(const mat4_t *m, int row, __m256 x, __m256 y, __m256 z) {
+  __m256 result = _mm256_mul_ps(_mm256_set1_ps(m->m[row][0]), x);
+  result =
+      _mm256_add_ps(result, _mm256_mul_ps(_mm256_set1_ps(m->m[row][1]), y));
+  result =
+      _mm256_add_ps(result, _mm256_mul_ps(_mm256_set1_ps(m->m[row][2]), z));
+  return _mm256_add_ps(result, _mm256_set1_ps(m->m[row][3]));
+}
+
+__attribute__((target("avx"))) int
+mat4_mul_vec3_streams_avx(const mat4_t *m, const float *x, const float *y,
+                          const float *z, int count, float *out_x,
+                          float *out_y, float *out_z, float *out_w) {
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256 vx = _mm256_loadu_ps(&x[i]);
+    __m256 vy = _mm256_loadu_ps(&y[i]);
+    __m256 vz = _mm256_loadu_ps(&z[i]);
+    _mm256_storeu_ps(&out_x[i], row_lanes_avx(m, 0, vx, vy, vz));
+    _mm256_storeu_ps(&out_y[i], row_lanes_avx(m, 1, vx, vy, vz));
+    _mm256_storeu_ps(&out_z[i], row_lanes_avx(m, 2, vx, vy, vz));
+    _mm256_storeu_ps(&out_w[i], row_lanes_avx(m, 3, vx, vy, vz));
+  }
+  return i;
+}
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef MATRIX_SIMD_H
+#define MATRIX_SIMD_H
+
+#include "matrix.h"
+
+// Like the span kernels, the SIMD stream transforms are built for x86 only,
+// using per-function target attributes. Which one runs is decided at startup
+// by init_matrix_kernels()
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define MATRIX_SIMD_X86 1
+#else
+#define MATRIX_SIMD_X86 0
+#endif
+
+#if MATRIX_SIMD_X86
+// Transform as many whole groups of 4 (SSE) or 8 (AVX) vertices of the streams
+// as there are and return how many vertices that was. The caller transforms
+// the few left over
+int mat4_mul_vec3_streams_sse(const mat4_t *m, const float *x, const float *y,
+                              const float *z, int count, float *out_x,
+                              float *out_y, float *out_z, float *out_w);
+int mat4_mul_vec3_streams_avx(const mat4_t *m, const float *x, const float *y,
+                              const float *z, int count, float *out_x,
+                              float *out_y, float *out_z, float *out_w);
+#endif
+
+#endif
@@ -1,6 +1,9 @@
 #include "mesh.h"
 #include "array.h"
+#include "simplify.h"
+#include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 // MACRO DEFINITIONS
@@ -9,6 +12,11 @@
 #define MAX_NUM_MESHES 10
 static mesh_t meshes[MAX_NUM_MESHES];
 static int mesh_count = 0;
+static int lod_method = LOD_SCREEN_ERROR;
+
+void set_lod_method(int method) { lod_method = method; }
+
+bool is_lod_enabled(void) { return lod_method == LOD_SCREEN_ERROR; }
 
 void load_mesh(char *obj_filename, char *png_filename, vec3_t scale,
                vec3_t translation, vec3_t rotation) {
@@ -23,6 +31,101 @@ void load_mesh(char *obj_filename, char *png_filename, vec3_t scale,
   mesh_count++;
 }
 
+face_plane_t compute_face_plane(const vec3_t *vertices, const face_t *face) {
+  vec3_t a = vertices[face->a - 1];
+  vec3_t b = vertices[face->b - 1];
+  vec3_t c = vertices[face->c - 1];
+  vec3_t normal = vec3_cross(vec3_sub(b, a), vec3_sub(c, a));
+  if (vec3_length(normal) > 0) {
+    vec3_normalize(&normal);
+  }
+  face_plane_t plane = {.normal = normal, .distance = vec3_dot(normal, a)};
+  return plane;
+}
+
+/**
+ * Set up a level of detail from faces that index the vertices of a mesh. The
+ * level keeps its own copy of the faces and of the vertices they use, in the
+ * order the faces first use them, and builds its hierarchy, face planes and
+ * position streams
+ */
+static void init_mesh_lod(mesh_lod_t *lod, const vec3_t *vertices,
+                          int num_vertices, const face_t *faces, int num_faces,
+                          float error) {
+  *lod = (mesh_lod_t){.error = error};
+  lod->faces = (face_t *)malloc(sizeof(face_t) * num_faces);
+  int *remap = (int *)malloc(sizeof(int) * num_vertices);
+  lod->vertices = (vec3_t *)malloc(sizeof(vec3_t) * num_vertices);
+  if (lod->faces == NULL || remap == NULL || lod->vertices == NULL) {
+    free(lod->faces);
+    free(remap);
+    free(lod->vertices);
+    *lod = (mesh_lod_t){.error = error};
+    return;
+  }
+  memcpy(lod->faces, faces, sizeof(face_t) * num_faces);
+  lod->num_faces = num_faces;
+
+  // Group the faces into a hierarchy of boxes, so the parts of a big mesh
+  // outside the frustum can be skipped together. This reorders the faces
+  lod->bvh_nodes = build_bvh(vertices, lod->faces, num_faces,
+                             &lod->num_bvh_nodes);
+
+  // Number the vertices in the order the faces first use them, leaving out
+  // the ones no face of the level uses
+  for (int i = 0; i < num_vertices; i++) {
+    remap[i] = 0;
+  }
+  for (int i = 0; i < num_faces; i++) {
+    int *corners[3] = {&lod->faces[i].a, &lod->faces[i].b, &lod->faces[i].c};
+    for (int j = 0; j < 3; j++) {
+      int v = *corners[j] - 1;
+      if (remap[v] == 0) {
+        lod->vertices[lod->num_vertices++] = vertices[v];
+        remap[v] = lod->num_vertices;
+      }
+      *corners[j] = remap[v];
+    }
+  }
+  free(remap);
+
+  // The plane of every face, for backface culling in object space
+  lod->face_planes = (face_plane_t *)malloc(sizeof(face_plane_t) * num_faces);
+  for (int i = 0; lod->face_planes != NULL && i < num_faces; i++) {
+    lod->face_planes[i] = compute_face_plane(lod->vertices, &lod->faces[i]);
+  }
+
+  // Keep a copy of the positions as x, y and z streams, which is the layout
+  // the batched SIMD transform reads
+  int count = lod->num_vertices;
+  lod->positions_x = (float *)malloc(sizeof(float) * count);
+  lod->positions_y = (float *)malloc(sizeof(float) * count);
+  lod->positions_z = (float *)malloc(sizeof(float) * count);
+  if (lod->positions_x == NULL || lod->positions_y == NULL ||
+      lod->positions_z == NULL) {
+    free(lod->positions_x);
+    free(lod->positions_y);
+    free(lod->positions_z);
+    lod->positions_x = lod->positions_y = lod->positions_z = NULL;
+    return;
+  }
+  for (int i = 0; i < count; i++) {
+    lod->positions_x[i] = lod->vertices[i].x;
+    lod->positions_y[i] = lod->vertices[i].y;
+    lod->positions_z[i] = lod->vertices[i].z;
+  }
+}
+
+static void free_mesh_lod(mesh_lod_t *lod) {
+  free(lod->vertices);
+  free(lod->positions_x);
+  free(lod->positions_y);
+  free(lod->positions_z);
+  free(lod->faces);
+  free(lod->face_planes);
+  free(lod->bvh_nodes);
+}
+
 void load_mesh_obj_data(mesh_t *mesh, char *obj_filename) {
   FILE *file;
   file = fopen(obj_filename, "r");
@@ -64,6 +167,54 @@ void load_mesh_obj_data(mesh_t *mesh, char *obj_filename) {
   }
   array_free(texcoords);
   fclose(file);
+
+  // Bound the vertices with a box and a sphere around the center of the box,
+  // so whole meshes can be tested against the frustum before their faces
+  int num_vertices = array_length(mesh->vertices);
+  mesh->aabb_min = mesh->aabb_max = vec3_new(0, 0, 0);
+  if (num_vertices > 0) {
+    mesh->aabb_min = mesh->aabb_max = mesh->vertices[0];
+  }
+  for (int i = 1; i < num_vertices; i++) {
+    vec3_t vertex = mesh->vertices[i];
+    mesh->aabb_min.x = fminf(mesh->aabb_min.x, vertex.x);
+    mesh->aabb_min.y = fminf(mesh->aabb_min.y, vertex.y);
+    mesh->aabb_min.z = fminf(mesh->aabb_min.z, vertex.z);
+    mesh->aabb_max.x = fmaxf(mesh->aabb_max.x, vertex.x);
+    mesh->aabb_max.y = fmaxf(mesh->aabb_max.y, vertex.y);
+    mesh->aabb_max.z = fmaxf(mesh->aabb_max.z, vertex.z);
+  }
+  mesh->sphere_center =
+      vec3_mul(vec3_add(mesh->aabb_min, mesh->aabb_max), 0.5);
+  mesh->sphere_radius = 0;
+  for (int i = 0; i < num_vertices; i++) {
+    float distance =
+        vec3_length(vec3_sub(mesh->vertices[i], mesh->sphere_center));
+    mesh->sphere_radius = fmaxf(mesh->sphere_radius, distance);
+  }
+
+  // The full mesh is the first level of detail, and quadric error
+  // simplification reduces it to a chain of levels with half as many faces
+  // as the one before, for meshes that cover few pixels
+  int num_faces = array_length(mesh->faces);
+  init_mesh_lod(&mesh->lods[0], mesh->vertices, num_vertices, mesh->faces,
+                num_faces, 0);
+  mesh->num_lods = 1;
+
+  int targets[MAX_MESH_LODS - 1];
+  int num_targets = 0;
+  for (int faces = num_faces / 2;
+       faces >= MIN_LOD_FACES && num_targets < MAX_MESH_LODS - 1; faces /= 2) {
+    targets[num_targets++] = faces;
+  }
+  simplified_level_t levels[MAX_MESH_LODS - 1];
+  int num_levels = simplify_mesh(mesh->vertices, num_vertices, mesh->faces,
+                                 num_faces, targets, num_targets, levels);
+  for (int i = 0; i < num_levels; i++) {
+    init_mesh_lod(&mesh->lods[mesh->num_lods++], mesh->vertices, num_vertices,
+                  levels[i].faces, levels[i].num_faces, levels[i].error);
+    free(levels[i].faces);
+  }
 }
 
 void load_mesh_png_data(mesh_t *mesh, char *png_filename) {
@@ -71,19 +222,80 @@ void load_mesh_png_data(mesh_t *mesh, char *png_filename) {
   if (png_image != NULL) {
     upng_decode(png_image);
     if (upng_get_error(png_image) == UPNG_EOK) {
-      mesh->texture = png_image;
+      mesh->texture = texture_from_png(png_image);
     }
   }
 }
 
+mat4_t update_mesh_transform(mesh_t *mesh, mat4_t view_matrix,
+                             bool view_changed) {
+  mesh_transform_t *transform = &mesh->transform;
+  bool world_changed = !transform->valid ||
+                       !vec3_equal(mesh->scale, transform->scale) ||
+                       !vec3_equal(mesh->rotation, transform->rotation) ||
+                       !vec3_equal(mesh->translation, transform->translation);
+
+  if (world_changed) {
+    transform->scale = mesh->scale;
+    transform->rotation = mesh->rotation;
+    transform->translation = mesh->translation;
+
+    // Create a World Matrix combining scale, rotation and translation
+    // matrices Since matrix multiplication is not commutative, order
+    // matters! (scale, rotate, translate)
+    mat4_t world_matrix =
+        mat4_make_scale(mesh->scale.x, mesh->scale.y, mesh->scale.z);
+    world_matrix =
+        mat4_mul_mat4(mat4_make_rotation_z(mesh->rotation.z), world_matrix);
+    world_matrix =
+        mat4_mul_mat4(mat4_make_rotation_y(mesh->rotation.y), world_matrix);
+    world_matrix =
+        mat4_mul_mat4(mat4_make_rotation_x(mesh->rotation.x), world_matrix);
+    world_matrix = mat4_mul_mat4(
+        mat4_make_translation(mesh->translation.x, mesh->translation.y,
+                              mesh->translation.z),
+        world_matrix);
+    transform->world_matrix = world_matrix;
+  }
+
+  if (world_changed || view_changed) {
+    transform->model_view_matrix =
+        mat4_mul_mat4(view_matrix, transform->world_matrix);
+    transform->normal_matrix =
+        mat4_make_normal_matrix(transform->model_view_matrix);
+    transform->camera_position = mat4_inverse_transform_point(
+        transform->model_view_matrix, vec3_new(0, 0, 0));
+    transform->is_mirrored =
+        mat4_determinant3(transform->model_view_matrix) < 0;
+  }
+  transform->valid = true;
+  return transform->model_view_matrix;
+}
+
+int select_mesh_lod(const mesh_t *mesh, float pixels_per_unit) {
+  if (!is_lod_enabled() || pixels_per_unit <= 0) {
+    return 0;
+  }
+  // Errors only grow down the chain
+  int level = 0;
+  while (level + 1 < mesh->num_lods &&
+         mesh->lods[level + 1].error * pixels_per_unit < LOD_PIXEL_ERROR) {
+    level++;
+  }
+  return level;
+}
+
 int get_num_meshes(void) { return mesh_count; }
 
 mesh_t *get_mesh(int index) { return &meshes[index]; }
 
 void free_meshes(void) {
   for (int i = 0; i < mesh_count; i++) {
-    upng_free(meshes[i].texture);
+    texture_free(&meshes[i].texture);
     array_free(meshes[i].faces);
     array_free(meshes[i].vertices);
+    for (int j = 0; j < meshes[i].num_lods; j++) {
+      free_mesh_lod(&meshes[i].lods[j]);
+    }
   }
 }
@@ -2,19 +2,79 @@
 #define MESH_H
 
 // USER-DEFINED INCLUDES
+#include "bvh.h"
+#include "texture.h"
 #include "triangle.h"
+#include "matrix.h"
 #include "upng.h"
 #include "vector.h"
+#include <stdbool.h>
+
+// mesh_transform_t caches the matrices that take the vertices of a mesh to
+// camera space, along with the values they were built from, so they are only
+// rebuilt when those change
+typedef struct {
+  vec3_t rotation; // values world_matrix was built from
+  vec3_t scale;
+  vec3_t translation;
+  mat4_t world_matrix;      // scale, then rotate, then translate
+  mat4_t model_view_matrix; // world matrix followed by the view matrix
+  mat4_t normal_matrix;     // takes object space face normals to camera space
+  vec3_t camera_position;   // the camera in object space
+  bool is_mirrored;         // the model-view matrix flips the winding
+  bool valid;
+} mesh_transform_t;
+
+// face_plane_t is the object space plane a face lies in: the points p with
+// dot(normal, p) == distance. The normal points out of the front of the face
+typedef struct {
+  vec3_t normal;
+  float distance;
+} face_plane_t;
+
+// Levels of detail of a mesh at most, the full mesh included
+#define MAX_MESH_LODS 5
+// Levels are not reduced below this many faces
+#define MIN_LOD_FACES 64
+// A reduced level is only drawn while simplification moved its surface by
+// less than this many pixels on screen
+#define LOD_PIXEL_ERROR 1.0
+
+enum lod_method { LOD_NONE, LOD_SCREEN_ERROR };
+
+// mesh_lod_t is one level of detail of a mesh, ready to draw: its own
+// vertices, only the ones its faces use, and everything built from them
+typedef struct {
+  vec3_t *vertices;          // vertices the faces of the level use
+  int num_vertices;
+  float *positions_x;        // the vertices again as separate x, y and z
+  float *positions_y;        // streams for the batched transform, NULL if
+  float *positions_z;        // they could not be allocated
+  face_t *faces;             // faces, indexing vertices from 1
+  int num_faces;
+  face_plane_t *face_planes; // one plane per face, NULL if not allocated
+  bvh_node_t *bvh_nodes;     // hierarchy over the faces, NULL if none
+  int num_bvh_nodes;
+  float error; // how far the surface moved in object space, 0 for the full
+               // mesh
+} mesh_lod_t;
 
 // define a struct for dynamically sized meshes with arrays of faces and
 // vertices
 typedef struct {
-  vec3_t *vertices;   // dynamic array of vertices
-  face_t *faces;      // dynamic array of faces
-  upng_t *texture;    // pointer to mesh PNG texture
-  vec3_t rotation;    // rotation with x, y, and z values
-  vec3_t scale;       // scale with x, y and z values
-  vec3_t translation; // translate with x, y and z values
+  vec3_t *vertices;           // dynamic array of vertices
+  face_t *faces;              // dynamic array of faces
+  mesh_lod_t lods[MAX_MESH_LODS]; // the full mesh first, then coarser and
+  int num_lods;               // coarser reductions of it
+  texture_t texture;          // mesh PNG texture
+  vec3_t rotation;            // rotation with x, y, and z values
+  vec3_t scale;               // scale with x, y and z values
+  vec3_t translation;         // translate with x, y and z values
+  mesh_transform_t transform; // cached matrices, see update_mesh_transform()
+  vec3_t aabb_min;            // object space bounding box of the vertices
+  vec3_t aabb_max;
+  vec3_t sphere_center; // object space bounding sphere, centered on the box
+  float sphere_radius;
 } mesh_t;
 
 void load_mesh(char *obj_filename, char *png_filename, vec3_t scale,
@@ -22,6 +82,41 @@ void load_mesh(char *obj_filename, char *png_filename, vec3_t scale,
 void load_mesh_obj_data(mesh_t *mesh, char *obj_filename);
 void load_mesh_png_data(mesh_t *mesh, char *png_filename);
 
+/**
+ * Plane of a face in object space. Its normal follows the winding of the
+ * face: (b - a) x (c - a), normalized
+ */
+face_plane_t compute_face_plane(const vec3_t *vertices, const face_t *face);
+
+void set_lod_method(int method);
+bool is_lod_enabled(void);
+
+/**
+ * Pick the coarsest level of detail of a mesh whose error stays under
+ * LOD_PIXEL_ERROR on screen
+ *
+ * @param  mesh: mesh to pick a level of
+ * @param  pixels_per_unit: how many pixels an object space unit of the mesh
+ *         covers at its nearest point to the camera, or 0 or less when the
+ *         camera is inside its bounds
+ * @return index into mesh->lods
+ */
+int select_mesh_lod(const mesh_t *mesh, float pixels_per_unit);
+
+/**
+ * Bring the cached matrices of a mesh up to date and return its model-view
+ * matrix. The world matrix is only rebuilt when the scale, rotation or
+ * translation of the mesh changed, and the model-view matrix, along with the
+ * normal matrix and the camera position in object space, only when either the
+ * world matrix or the view matrix did
+ *
+ * @param  mesh: mesh whose transform to update
+ * @param  view_matrix: view matrix of the camera for this frame
+ * @param  view_changed: whether view_matrix differs from the last frame's
+ */
+mat4_t update_mesh_transform(mesh_t *mesh, mat4_t view_matrix,
+                             bool view_changed);
+
 int get_num_meshes(void);
 mesh_t *get_mesh(int index);
 
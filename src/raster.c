@@ -0,0 +1,229 @@
+#include "raster.h"
+#include "job.h"
+#include <stdlib.h>
+#include <string.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Tile-binned rasterization
+///////////////////////////////////////////////////////////////////////////////
+// A frame is drawn in two passes over the job pool:
+//
+//  1. binning: the triangle list is cut into NUM_BIN_JOBS contiguous chunks.
+//     Each job sets up the triangles of its chunk and appends their indices to
+//     its own bin of every tile they overlap.
+//  2. tiles: each job takes one tile and walks the bins of all chunks in chunk
+//     order, drawing the triangles clipped to the tile rectangle.
+//
+// Every bin has exactly one writer and every tile exactly one thread drawing
+// into it, so neither the bins nor the color and depth buffers need locks, and
+// the triangles of a tile are drawn in submission order.
+//
+// In deferred mode a tile is drawn in two steps instead. The triangles only
+// write depth and their index into the visibility buffer, then every pixel of
+// the tile is shaded once, for the triangle that ended up in front. Hidden
+// fragments never pay for a texture fetch, however much overdraw there is.
+///////////////////////////////////////////////////////////////////////////////
+
+#define NUM_BIN_JOBS 64
+
+// Indices into the frame's triangle list that overlap a tile
+typedef struct {
+  int *triangles;
+  int count;
+  int capacity;
+} tile_bin_t;
+
+static int tiles_x = 0;
+static int tiles_y = 0;
+static int num_tiles = 0;
+
+// NUM_BIN_JOBS * num_tiles bins, one row of num_tiles per binning job
+static tile_bin_t *bins = NULL;
+
+// Index of the triangle in front at every pixel of the window, NO_TRIANGLE
+// where there is none. Only used in deferred mode
+#define NO_TRIANGLE 0xFFFFFFFF
+static uint32_t *visibility_buffer = NULL;
+
+// Setups of the current frame's triangles, indexed like the triangle list
+static triangle_setup_t *setups = NULL;
+static int setups_capacity = 0;
+
+typedef struct {
+  const triangle_t *triangles;
+  int num_triangles;
+  bool textured;
+  bool deferred;
+} raster_frame_t;
+
+// The frame whose tiles are being drawn between begin_rasterize_triangles()
+// and finish_rasterize_triangles(), and their batch on the job pool
+static raster_frame_t current_frame;
+static job_batch_t tile_batch;
+
+void init_raster(void) {
+  tiles_x = (get_window_width() + TILE_SIZE - 1) / TILE_SIZE;
+  tiles_y = (get_window_height() + TILE_SIZE - 1) / TILE_SIZE;
+  num_tiles = tiles_x * tiles_y;
+  bins = (tile_bin_t *)calloc(NUM_BIN_JOBS * num_tiles, sizeof(tile_bin_t));
+  visibility_buffer = (uint32_t *)malloc(
+      sizeof(uint32_t) * get_window_width() * get_window_height());
+}
+
+static void bin_push(tile_bin_t *bin, int triangle_index) {
+  if (bin->count == bin->capacity) {
+    bin->capacity = bin->capacity ? bin->capacity * 2 : 64;
+    bin->triangles =
+        (int *)realloc(bin->triangles, sizeof(int) * bin->capacity);
+  }
+  bin->triangles[bin->count++] = triangle_index;
+}
+
+static void bin_triangles_job(void *data, int job_index) {
+  const raster_frame_t *frame = data;
+  tile_bin_t *job_bins = &bins[job_index * num_tiles];
+  for (int t = 0; t < num_tiles; t++) {
+    job_bins[t].count = 0;
+  }
+
+  int first = (long long)frame->num_triangles * job_index / NUM_BIN_JOBS;
+  int last = (long long)frame->num_triangles * (job_index + 1) / NUM_BIN_JOBS;
+  for (int i = first; i < last; i++) {
+    triangle_setup_t *setup = &setups[i];
+    if (!setup_triangle_to_render(setup, &frame->triangles[i],
+                                  frame->textured)) {
+      continue;
+    }
+
+    int tile_min_x = setup->min_x / TILE_SIZE;
+    int tile_min_y = setup->min_y / TILE_SIZE;
+    int tile_max_x = setup->max_x / TILE_SIZE;
+    int tile_max_y = setup->max_y / TILE_SIZE;
+    bool single_tile = tile_min_x == tile_max_x && tile_min_y == tile_max_y;
+
+    for (int tile_y = tile_min_y; tile_y <= tile_max_y; tile_y++) {
+      for (int tile_x = tile_min_x; tile_x <= tile_max_x; tile_x++) {
+        // The bounding box can overlap tiles that long thin triangles miss
+        int min_x = tile_x * TILE_SIZE;
+        int min_y = tile_y * TILE_SIZE;
+        if (single_tile ||
+            triangle_overlaps_rect(setup, min_x, min_y, min_x + TILE_SIZE - 1,
+                                   min_y + TILE_SIZE - 1)) {
+          bin_push(&job_bins[tile_y * tiles_x + tile_x], i);
+        }
+      }
+    }
+  }
+}
+
+// Shade every pixel of the tile from the triangle the visibility buffer holds
+// for it, a run of neighbouring pixels of the same triangle at a time
+static void resolve_tile(int min_x, int min_y, int max_x, int max_y) {
+  int window_width = get_window_width();
+  uint32_t *color_buffer = get_color_buffer();
+  for (int y = min_y; y <= max_y; y++) {
+    const uint32_t *id_row = &visibility_buffer[window_width * y];
+    uint32_t *color_row = &color_buffer[window_width * y];
+    int x = min_x;
+    while (x <= max_x) {
+      uint32_t id = id_row[x];
+      int run_end = x;
+      while (run_end < max_x && id_row[run_end + 1] == id) {
+        run_end++;
+      }
+      if (id != NO_TRIANGLE) {
+        shade_triangle_run(&setups[id], color_row, y, x, run_end);
+      }
+      x = run_end + 1;
+    }
+  }
+}
+
+static void rasterize_tile_job(void *data, int tile) {
+  const raster_frame_t *frame = data;
+  int tile_x = tile % tiles_x;
+  int tile_y = tile / tiles_x;
+  int min_x = tile_x * TILE_SIZE;
+  int min_y = tile_y * TILE_SIZE;
+  int max_x = min_x + TILE_SIZE - 1;
+  int max_y = min_y + TILE_SIZE - 1;
+
+  // Clear the tile right before drawing into it, so it is still in the cache
+  // when the triangles land on it. Its depth only matters if any do
+  if (is_clear_lazy()) {
+    bool has_triangles = false;
+    for (int job_index = 0; job_index < NUM_BIN_JOBS && !has_triangles;
+         job_index++) {
+      has_triangles = bins[job_index * num_tiles + tile].count > 0;
+    }
+    clear_tile(tile_x, tile_y, has_triangles);
+  }
+
+  if (frame->deferred) {
+    // Tiles on the right and bottom edges can stick out of the window
+    if (max_x >= get_window_width())
+      max_x = get_window_width() - 1;
+    if (max_y >= get_window_height())
+      max_y = get_window_height() - 1;
+    for (int y = min_y; y <= max_y; y++) {
+      memset(&visibility_buffer[get_window_width() * y + min_x], 0xFF,
+             sizeof(uint32_t) * (max_x - min_x + 1));
+    }
+  }
+
+  for (int job_index = 0; job_index < NUM_BIN_JOBS; job_index++) {
+    const tile_bin_t *bin = &bins[job_index * num_tiles + tile];
+    for (int i = 0; i < bin->count; i++) {
+      const triangle_setup_t *setup = &setups[bin->triangles[i]];
+
+      // Skip triangles that are entirely behind everything in this tile
+      if (setup->min_depth >= get_z_tile_far(tile_x, tile_y)) {
+        continue;
+      }
+      bool drew;
+      if (frame->deferred) {
+        drew = rasterize_triangle_id_in_rect(setup, bin->triangles[i],
+                                             visibility_buffer, min_x, min_y,
+                                             max_x, max_y);
+      } else {
+        drew = rasterize_triangle_in_rect(setup, min_x, min_y, max_x, max_y);
+      }
+      if (drew) {
+        update_z_tile(tile_x, tile_y);
+      }
+    }
+  }
+
+  if (frame->deferred) {
+    resolve_tile(min_x, min_y, max_x, max_y);
+  }
+}
+
+void begin_rasterize_triangles(const triangle_t *triangles, int num_triangles,
+                               bool textured, bool deferred) {
+  if (num_triangles > setups_capacity) {
+    setups_capacity = num_triangles;
+    setups = (triangle_setup_t *)realloc(
+        setups, sizeof(triangle_setup_t) * setups_capacity);
+  }
+
+  current_frame =
+      (raster_frame_t){triangles, num_triangles, textured, deferred};
+  run_jobs(NUM_BIN_JOBS, bin_triangles_job, &current_frame);
+  start_jobs(&tile_batch, num_tiles, rasterize_tile_job, &current_frame);
+}
+
+void finish_rasterize_triangles(void) { finish_jobs(&tile_batch); }
+
+void destroy_raster(void) {
+  for (int i = 0; i < NUM_BIN_JOBS * num_tiles; i++) {
+    free(bins[i].triangles);
+  }
+  free(bins);
+  bins = NULL;
+  free(visibility_buffer);
+  visibility_buffer = NULL;
+  free(setups);
+  setups = NULL;
+  setups_capacity = 0;
+}
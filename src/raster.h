@@ -0,0 +1,48 @@
+#ifndef RASTER_H
+#define RASTER_H
+
+#include "display.h"
+#include "triangle.h"
+#include <stdbool.h>
+
+// The screen is split into square tiles of TILE_SIZE pixels that are
+// rasterized independently. They are the tiles of the hierarchical z-buffer,
+// made of whole 8x8 blocks, so neither the SIMD span kernels nor the z-buffer
+// blocks ever straddle two tiles
+#define TILE_SIZE Z_TILE_SIZE
+
+/**
+ * Allocate the tile bins and the visibility buffer for the current window
+ * size. Call after the window and the job pool have been initialized
+ */
+void init_raster(void);
+
+/**
+ * Start rasterizing a frame's worth of projected triangles into the color and
+ * depth buffers. Triangles are set up and binned into the screen tiles they
+ * overlap, then every tile is drawn on its own, spread over the job pool.
+ * Within a tile triangles are drawn in the order they were given, so the
+ * result is the same as drawing them one by one. If clearing is lazy (see
+ * set_clear_method()) every tile is cleared first, by the thread that draws it
+ *
+ * Returns once the triangles are binned, while the worker threads draw the
+ * tiles. The triangles must stay valid until finish_rasterize_triangles()
+ *
+ * @param  triangles: projected triangles to draw
+ * @param  num_triangles: number of triangles
+ * @param  textured: sample each triangle's texture instead of its flat color
+ * @param  deferred: resolve visibility first through a visibility buffer and
+ *                   shade each pixel only once, for the triangle in front
+ */
+void begin_rasterize_triangles(const triangle_t *triangles, int num_triangles,
+                               bool textured, bool deferred);
+
+/**
+ * Draw the tiles no worker thread has started yet and wait for the rest, after
+ * which the color and depth buffers hold the frame
+ */
+void finish_rasterize_triangles(void);
+
+void destroy_raster(void);
+
+#endif
@@ -0,0 +1,548 @@
+#include "simplify.h"
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Quadric error mesh simplification
+///////////////////////////////////////////////////////////////////////////////
+// Every vertex carries a quadric: the area weighted sum of the squared
+// distance functions to the planes of the faces around it. Divided by its
+// weight and evaluated at a point, it is the mean squared distance of that
+// point to those planes. When vertex U is collapsed onto its neighbour V the
+// faces that had edge UV disappear, the rest of the faces of U move their
+// corner to V, and V inherits the quadric of U, so the quadric of a vertex
+// keeps measuring the distance to all of the original surface it now stands
+// in for. The cost of a collapse is the quadric of U plus V at V.
+//
+// Collapses are done in passes. A pass lists every possible collapse sorted by
+// cost and goes through them cheapest first, skipping any that involve a
+// vertex a collapse in this pass already changed the faces of, so the
+// adjacency it was set up with stays valid. A collapse is also skipped when
+// it would fold a face over, or pinch the surface where U and V share more
+// neighbours than the faces on their edge.
+//
+// Meshes often split their vertices where the texture coordinates change, so
+// vertices at the same position are welded into one before anything else, and
+// texture coordinates are only looked at per corner of the faces. An edge is
+// a seam when the faces on either side of it disagree on the texture
+// coordinates of its ends, and a border when it has a face on one side only.
+// A vertex with no such edge collapses onto any neighbour. A vertex on
+// exactly two of them is on a seam or border line and only collapses along
+// it, onto the next vertex of that line, so the line keeps its shape and the
+// faces on each side keep texture coordinates of their own side. Any other
+// vertex, a corner where lines meet, is never collapsed. Every seam and
+// border edge also adds the plane through it at right angles to its face to
+// the quadrics of its ends, which holds the line in place.
+///////////////////////////////////////////////////////////////////////////////
+
+// How a vertex may collapse, worked out every pass
+enum vertex_kind { VERTEX_INTERIOR, VERTEX_SEAM, VERTEX_LOCKED };
+
+// Symmetric 4x4 matrix of a quadric, upper triangle by rows, and the total
+// weight of the planes in it:
+// aa ab ac ad bb bc bd cc cd dd
+typedef struct {
+  double q[10];
+  double weight;
+} quadric_t;
+
+typedef struct {
+  float cost;
+  int from;
+  int to;
+} collapse_t;
+
+typedef struct {
+  const vec3_t *vertices;
+  int num_vertices;
+  face_t *faces;
+  bool *removed;
+  int num_faces;
+  int num_alive;
+  quadric_t *quadrics;
+  // faces around every vertex, rebuilt every pass
+  int *face_offsets;
+  int *vertex_faces;
+  unsigned char *kinds;
+  bool *touched;
+  int *marks;
+  int mark;
+  float error;
+} simplifier_t;
+
+// vertices being welded, for compare_positions()
+static const vec3_t *weld_vertices;
+
+static void quadric_add_plane(quadric_t *quadric, vec3_t normal,
+                              vec3_t point, double weight) {
+  double plane[4] = {normal.x, normal.y, normal.z, -vec3_dot(normal, point)};
+  int k = 0;
+  for (int i = 0; i < 4; i++) {
+    for (int j = i; j < 4; j++) {
+      quadric->q[k++] += weight * plane[i] * plane[j];
+    }
+  }
+  quadric->weight += weight;
+}
+
+// Mean squared distance of p to the planes of two quadrics together
+static double quadric_error(const quadric_t *a, const quadric_t *b, vec3_t p) {
+  double q[10];
+  for (int i = 0; i < 10; i++) {
+    q[i] = a->q[i] + b->q[i];
+  }
+  double weight = a->weight + b->weight;
+  if (weight <= 0) {
+    return 0;
+  }
+  double x = p.x, y = p.y, z = p.z;
+  double error = q[0] * x * x + 2 * q[1] * x * y + 2 * q[2] * x * z +
+                 2 * q[3] * x + q[4] * y * y + 2 * q[5] * y * z +
+                 2 * q[6] * y + q[7] * z * z + 2 * q[8] * z + q[9];
+  return fmax(error / weight, 0);
+}
+
+static int *face_corner(face_t *face, int corner) {
+  return corner == 0 ? &face->a : corner == 1 ? &face->b : &face->c;
+}
+
+static tex2_t *face_corner_uv(face_t *face, int corner) {
+  return corner == 0 ? &face->a_uv : corner == 1 ? &face->b_uv : &face->c_uv;
+}
+
+// Corner of a face at a vertex (indexed from 0), or -1
+static int find_corner(const face_t *face, int vertex) {
+  return face->a - 1 == vertex   ? 0
+         : face->b - 1 == vertex ? 1
+         : face->c - 1 == vertex ? 2
+                                 : -1;
+}
+
+static bool uv_equal(tex2_t a, tex2_t b) { return a.u == b.u && a.v == b.v; }
+
+static vec3_t face_normal(const simplifier_t *s, const face_t *face) {
+  vec3_t a = s->vertices[face->a - 1];
+  vec3_t b = s->vertices[face->b - 1];
+  vec3_t c = s->vertices[face->c - 1];
+  return vec3_cross(vec3_sub(b, a), vec3_sub(c, a));
+}
+
+static int compare_positions(const void *a, const void *b) {
+  vec3_t p = weld_vertices[*(const int *)a];
+  vec3_t q = weld_vertices[*(const int *)b];
+  if (p.x != q.x) {
+    return p.x < q.x ? -1 : 1;
+  }
+  if (p.y != q.y) {
+    return p.y < q.y ? -1 : 1;
+  }
+  if (p.z != q.z) {
+    return p.z < q.z ? -1 : 1;
+  }
+  return *(const int *)a - *(const int *)b;
+}
+
+static int compare_collapses(const void *a, const void *b) {
+  float cost_a = ((const collapse_t *)a)->cost;
+  float cost_b = ((const collapse_t *)b)->cost;
+  return (cost_a > cost_b) - (cost_a < cost_b);
+}
+
+// Point the corners of the faces at the first of the vertices at their
+// position, and drop faces that end up with two corners on one vertex
+static bool weld_vertices_by_position(simplifier_t *s) {
+  int *order = (int *)malloc(sizeof(int) * s->num_vertices);
+  int *canonical = (int *)malloc(sizeof(int) * s->num_vertices);
+  if (order == NULL || canonical == NULL) {
+    free(order);
+    free(canonical);
+    return false;
+  }
+  for (int v = 0; v < s->num_vertices; v++) {
+    order[v] = v;
+  }
+  weld_vertices = s->vertices;
+  qsort(order, s->num_vertices, sizeof(int), compare_positions);
+  for (int i = 0; i < s->num_vertices; i++) {
+    bool same = i > 0 && vec3_equal(s->vertices[order[i]],
+                                    s->vertices[order[i - 1]]);
+    canonical[order[i]] = same ? canonical[order[i - 1]] : order[i];
+  }
+
+  for (int f = 0; f < s->num_faces; f++) {
+    face_t *face = &s->faces[f];
+    for (int corner = 0; corner < 3; corner++) {
+      int *index = face_corner(face, corner);
+      *index = canonical[*index - 1] + 1;
+    }
+    if (face->a == face->b || face->b == face->c || face->c == face->a) {
+      s->removed[f] = true;
+      s->num_alive--;
+    }
+  }
+  free(order);
+  free(canonical);
+  return true;
+}
+
+// List the faces that are left around every vertex
+static void build_adjacency(simplifier_t *s) {
+  memset(s->face_offsets, 0, sizeof(int) * (s->num_vertices + 1));
+  for (int f = 0; f < s->num_faces; f++) {
+    if (!s->removed[f]) {
+      for (int corner = 0; corner < 3; corner++) {
+        s->face_offsets[*face_corner(&s->faces[f], corner)]++;
+      }
+    }
+  }
+  // Face indices are from 1, so after the prefix sum face_offsets[v] is the
+  // start of vertex v (from 0) and face_offsets[v + 1] its end
+  for (int v = 0; v < s->num_vertices; v++) {
+    s->face_offsets[v + 1] += s->face_offsets[v];
+  }
+  int *next = s->marks;
+  memcpy(next, s->face_offsets, sizeof(int) * s->num_vertices);
+  for (int f = 0; f < s->num_faces; f++) {
+    if (!s->removed[f]) {
+      for (int corner = 0; corner < 3; corner++) {
+        int v = *face_corner(&s->faces[f], corner) - 1;
+        s->vertex_faces[next[v]++] = f;
+      }
+    }
+  }
+  memset(s->marks, 0, sizeof(int) * s->num_vertices);
+  s->mark = 0;
+}
+
+// Whether edge VW is a seam or a border
+static bool is_seam_edge(simplifier_t *s, int v, int w) {
+  face_t *edge_faces[2];
+  int num_edge_faces = 0;
+  for (int i = s->face_offsets[v]; i < s->face_offsets[v + 1]; i++) {
+    face_t *face = &s->faces[s->vertex_faces[i]];
+    if (find_corner(face, w) >= 0) {
+      if (num_edge_faces == 2) {
+        return true;
+      }
+      edge_faces[num_edge_faces++] = face;
+    }
+  }
+  if (num_edge_faces != 2) {
+    return true;
+  }
+  face_t *f = edge_faces[0];
+  face_t *g = edge_faces[1];
+  return !uv_equal(*face_corner_uv(f, find_corner(f, v)),
+                   *face_corner_uv(g, find_corner(g, v))) ||
+         !uv_equal(*face_corner_uv(f, find_corner(f, w)),
+                   *face_corner_uv(g, find_corner(g, w)));
+}
+
+static enum vertex_kind classify_vertex(simplifier_t *s, int v) {
+  if (s->face_offsets[v] == s->face_offsets[v + 1]) {
+    return VERTEX_LOCKED;
+  }
+  // Count the seam and border edges, once per neighbour
+  s->mark++;
+  s->marks[v] = s->mark;
+  int num_seam_edges = 0;
+  for (int i = s->face_offsets[v]; i < s->face_offsets[v + 1]; i++) {
+    face_t *face = &s->faces[s->vertex_faces[i]];
+    for (int corner = 0; corner < 3; corner++) {
+      int w = *face_corner(face, corner) - 1;
+      if (s->marks[w] != s->mark) {
+        s->marks[w] = s->mark;
+        num_seam_edges += is_seam_edge(s, v, w);
+      }
+    }
+  }
+  return num_seam_edges == 0   ? VERTEX_INTERIOR
+         : num_seam_edges == 2 ? VERTEX_SEAM
+                               : VERTEX_LOCKED;
+}
+
+// Hold the seam and border lines in place: the plane through every such edge
+// at right angles to its face goes into the quadrics of both its ends,
+// weighted by the edge length squared
+static void add_seam_quadrics(simplifier_t *s) {
+  for (int f = 0; f < s->num_faces; f++) {
+    if (s->removed[f]) {
+      continue;
+    }
+    face_t *face = &s->faces[f];
+    vec3_t normal = face_normal(s, face);
+    for (int corner = 0; corner < 3; corner++) {
+      int v = *face_corner(face, corner) - 1;
+      int w = *face_corner(face, (corner + 1) % 3) - 1;
+      if (!is_seam_edge(s, v, w)) {
+        continue;
+      }
+      vec3_t edge = vec3_sub(s->vertices[w], s->vertices[v]);
+      vec3_t side = vec3_cross(edge, normal);
+      float length = vec3_length(side);
+      if (length == 0) {
+        continue;
+      }
+      side = vec3_div(side, length);
+      double weight = vec3_dot(edge, edge);
+      quadric_add_plane(&s->quadrics[v], side, s->vertices[v], weight);
+      quadric_add_plane(&s->quadrics[w], side, s->vertices[v], weight);
+    }
+  }
+}
+
+// Mark the vertices of all faces around vertex v with a new mark, and return
+// it
+static int mark_neighbours(simplifier_t *s, int v) {
+  s->mark++;
+  for (int i = s->face_offsets[v]; i < s->face_offsets[v + 1]; i++) {
+    const face_t *face = &s->faces[s->vertex_faces[i]];
+    s->marks[face->a - 1] = s->mark;
+    s->marks[face->b - 1] = s->mark;
+    s->marks[face->c - 1] = s->mark;
+  }
+  return s->mark;
+}
+
+static void touch_neighbours(simplifier_t *s, int v) {
+  for (int i = s->face_offsets[v]; i < s->face_offsets[v + 1]; i++) {
+    const face_t *face = &s->faces[s->vertex_faces[i]];
+    s->touched[face->a - 1] = true;
+    s->touched[face->b - 1] = true;
+    s->touched[face->c - 1] = true;
+  }
+}
+
+// The face on edge UV that has the same texture coordinates at U as the
+// given face has, or NULL
+static face_t *find_edge_face_on_side(face_t *edge_faces[],
+                                      int num_edge_faces, int u,
+                                      face_t *face) {
+  tex2_t uv_u = *face_corner_uv(face, find_corner(face, u));
+  for (int i = 0; i < num_edge_faces; i++) {
+    face_t *edge_face = edge_faces[i];
+    if (uv_equal(*face_corner_uv(edge_face, find_corner(edge_face, u)),
+                 uv_u)) {
+      return edge_face;
+    }
+  }
+  return NULL;
+}
+
+// Collapse vertex u onto v if that keeps the surface and its texture mapping
+// intact
+static bool try_collapse(simplifier_t *s, int u, int v, float cost) {
+  // The faces on edge UV
+  face_t *edge_faces[2];
+  int num_edge_faces = 0;
+  for (int i = s->face_offsets[u]; i < s->face_offsets[u + 1]; i++) {
+    face_t *face = &s->faces[s->vertex_faces[i]];
+    if (find_corner(face, v) >= 0) {
+      if (num_edge_faces == 2) {
+        return false;
+      }
+      edge_faces[num_edge_faces++] = face;
+    }
+  }
+  if (num_edge_faces == 0) {
+    return false;
+  }
+
+  // U and V may only share the neighbours across their edge (the link
+  // condition), or the collapse would glue two parts of the surface together
+  int mark = mark_neighbours(s, u);
+  int num_shared = 0;
+  for (int i = s->face_offsets[v]; i < s->face_offsets[v + 1]; i++) {
+    face_t *face = &s->faces[s->vertex_faces[i]];
+    for (int corner = 0; corner < 3; corner++) {
+      int w = *face_corner(face, corner) - 1;
+      if (w != u && w != v && s->marks[w] == mark) {
+        s->marks[w] = 0;
+        num_shared++;
+      }
+    }
+  }
+  if (num_shared != num_edge_faces) {
+    return false;
+  }
+
+  // Every face that stays has to find a face on edge UV on its side of any
+  // seam through U to take the texture coordinates of V from, and may not
+  // turn over
+  for (int i = s->face_offsets[u]; i < s->face_offsets[u + 1]; i++) {
+    face_t *face = &s->faces[s->vertex_faces[i]];
+    if (find_corner(face, v) >= 0) {
+      continue;
+    }
+    face_t moved = *face;
+    *face_corner(&moved, find_corner(face, u)) = v + 1;
+    if (find_edge_face_on_side(edge_faces, num_edge_faces, u, face) == NULL ||
+        vec3_dot(face_normal(s, face), face_normal(s, &moved)) <= 0) {
+      return false;
+    }
+  }
+
+  for (int i = s->face_offsets[u]; i < s->face_offsets[u + 1]; i++) {
+    int f = s->vertex_faces[i];
+    face_t *face = &s->faces[f];
+    if (find_corner(face, v) >= 0) {
+      s->removed[f] = true;
+      s->num_alive--;
+      continue;
+    }
+    face_t *edge_face =
+        find_edge_face_on_side(edge_faces, num_edge_faces, u, face);
+    int corner = find_corner(face, u);
+    *face_corner(face, corner) = v + 1;
+    *face_corner_uv(face, corner) =
+        *face_corner_uv(edge_face, find_corner(edge_face, v));
+  }
+  for (int i = 0; i < 10; i++) {
+    s->quadrics[v].q[i] += s->quadrics[u].q[i];
+  }
+  s->quadrics[v].weight += s->quadrics[u].weight;
+  s->error = fmaxf(s->error, sqrtf(cost));
+
+  // The adjacency of everything around U and V is stale now
+  touch_neighbours(s, u);
+  touch_neighbours(s, v);
+  return true;
+}
+
+// Copy the faces that are left into a new level
+static bool take_level(const simplifier_t *s, simplified_level_t *level) {
+  level->faces = (face_t *)malloc(sizeof(face_t) * s->num_alive);
+  if (level->faces == NULL) {
+    return false;
+  }
+  level->num_faces = 0;
+  for (int f = 0; f < s->num_faces; f++) {
+    if (!s->removed[f]) {
+      level->faces[level->num_faces++] = s->faces[f];
+    }
+  }
+  level->error = s->error;
+  return true;
+}
+
+int simplify_mesh(const vec3_t *vertices, int num_vertices,
+                  const face_t *faces, int num_faces, const int targets[],
+                  int num_targets, simplified_level_t levels[]) {
+  simplifier_t s = {.vertices = vertices,
+                    .num_vertices = num_vertices,
+                    .num_faces = num_faces,
+                    .num_alive = num_faces};
+  s.faces = (face_t *)malloc(sizeof(face_t) * num_faces);
+  s.removed = (bool *)calloc(num_faces, sizeof(bool));
+  s.quadrics = (quadric_t *)calloc(num_vertices, sizeof(quadric_t));
+  s.face_offsets = (int *)malloc(sizeof(int) * (num_vertices + 1));
+  s.vertex_faces = (int *)malloc(sizeof(int) * 3 * num_faces);
+  s.kinds = (unsigned char *)malloc(num_vertices);
+  s.touched = (bool *)malloc(sizeof(bool) * num_vertices);
+  s.marks = (int *)malloc(sizeof(int) * num_vertices);
+  collapse_t *collapses =
+      (collapse_t *)malloc(sizeof(collapse_t) * 6 * num_faces);
+
+  int num_levels = 0;
+  if (s.faces == NULL || s.removed == NULL || s.quadrics == NULL ||
+      s.face_offsets == NULL || s.vertex_faces == NULL || s.kinds == NULL ||
+      s.touched == NULL || s.marks == NULL || collapses == NULL) {
+    goto done;
+  }
+  memcpy(s.faces, faces, sizeof(face_t) * num_faces);
+  if (!weld_vertices_by_position(&s)) {
+    goto done;
+  }
+
+  // Start every vertex off with the planes of its faces, weighted by their
+  // area, and of the seam and border edges it is on
+  for (int f = 0; f < num_faces; f++) {
+    if (s.removed[f]) {
+      continue;
+    }
+    vec3_t normal = face_normal(&s, &s.faces[f]);
+    float length = vec3_length(normal);
+    if (length == 0) {
+      continue;
+    }
+    for (int corner = 0; corner < 3; corner++) {
+      quadric_add_plane(&s.quadrics[*face_corner(&s.faces[f], corner) - 1],
+                        vec3_div(normal, length),
+                        vertices[s.faces[f].a - 1], length / 2);
+    }
+  }
+  build_adjacency(&s);
+  add_seam_quadrics(&s);
+
+  while (num_levels < num_targets) {
+    build_adjacency(&s);
+    for (int v = 0; v < num_vertices; v++) {
+      s.kinds[v] = classify_vertex(&s, v);
+      s.touched[v] = false;
+    }
+
+    // Both directions of every edge of every face. Edges between two faces
+    // are listed twice, and the second one is skipped as touched. Vertices
+    // on a seam or border only go along it
+    int num_collapses = 0;
+    for (int f = 0; f < num_faces; f++) {
+      if (s.removed[f]) {
+        continue;
+      }
+      for (int corner = 0; corner < 3; corner++) {
+        int a = *face_corner(&s.faces[f], corner) - 1;
+        int b = *face_corner(&s.faces[f], (corner + 1) % 3) - 1;
+        int ends[2][2] = {{a, b}, {b, a}};
+        for (int k = 0; k < 2; k++) {
+          int from = ends[k][0];
+          int to = ends[k][1];
+          if (s.kinds[from] == VERTEX_LOCKED ||
+              (s.kinds[from] == VERTEX_SEAM && !is_seam_edge(&s, from, to))) {
+            continue;
+          }
+          collapses[num_collapses++] = (collapse_t){
+              .cost = quadric_error(&s.quadrics[from], &s.quadrics[to],
+                                    vertices[to]),
+              .from = from,
+              .to = to};
+        }
+      }
+    }
+    qsort(collapses, num_collapses, sizeof(collapse_t), compare_collapses);
+
+    bool collapsed = false;
+    for (int i = 0; i < num_collapses && num_levels < num_targets; i++) {
+      collapse_t *collapse = &collapses[i];
+      if (s.touched[collapse->from] || s.touched[collapse->to]) {
+        continue;
+      }
+      if (!try_collapse(&s, collapse->from, collapse->to, collapse->cost)) {
+        continue;
+      }
+      collapsed = true;
+      while (num_levels < num_targets && s.num_alive <= targets[num_levels]) {
+        if (!take_level(&s, &levels[num_levels])) {
+          goto done;
+        }
+        num_levels++;
+      }
+    }
+    if (!collapsed) {
+      break;
+    }
+  }
+
+done:
+  free(s.faces);
+  free(s.removed);
+  free(s.quadrics);
+  free(s.face_offsets);
+  free(s.vertex_faces);
+  free(s.kinds);
+  free(s.touched);
+  free(s.marks);
+  free(collapses);
+  return num_levels;
+}
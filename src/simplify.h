@@ -0,0 +1,38 @@
+#ifndef SIMPLIFY_H
+#define SIMPLIFY_H
+
+#include "triangle.h"
+#include "vector.h"
+
+// simplified_level_t is one reduced level of detail of a mesh: faces that
+// index the vertices of the mesh it was simplified from, and how far
+// simplification may have moved the surface
+typedef struct {
+  face_t *faces; // allocated with malloc
+  int num_faces;
+  float error; // object space distance
+} simplified_level_t;
+
+/**
+ * Simplify a mesh by collapsing edges in the order of their quadric error,
+ * and take a snapshot of the faces every time their number falls to the next
+ * target. A vertex is only ever collapsed onto one of its neighbours, so the
+ * levels use the vertices of the mesh as they are. Vertices on UV seams or on
+ * the boundary of the mesh are never moved, which keeps the texture mapping
+ * intact
+ *
+ * @param  vertices: vertices of the mesh, indexed by the faces from 1
+ * @param  num_vertices: number of vertices
+ * @param  faces: faces of the mesh
+ * @param  num_faces: number of faces
+ * @param  targets: decreasing face counts to take the levels at
+ * @param  num_targets: number of targets
+ * @param  levels: filled with one level per target reached
+ * @return the number of levels filled, fewer than num_targets when the mesh
+ *         could not be simplified far enough
+ */
+int simplify_mesh(const vec3_t *vertices, int num_vertices,
+                  const face_t *faces, int num_faces, const int targets[],
+                  int num_targets, simplified_level_t levels[]);
+
+#endif
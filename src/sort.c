@@ -0,0 +1,132 @@
+#include "sort.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Front to back triangle sorting
+///////////////////////////////////////////////////////////////////////////////
+// Every triangle gets a 16 bit depth key: the top half of the float bits of
+// the sum of its w values (view space depths). Floats that are positive sort
+// like their bits, so the key keeps the exponent and 7 bits of mantissa, good
+// to about 1% of the depth, which is as close as front to back needs to be.
+//
+// The order of the previous frame is kept as a list of triangle indices. While
+// the number of triangles stays the same the camera and the meshes only moved
+// a little, so that order is nearly sorted and an insertion sort finishes it
+// in about one pass. When too much moved it gives up and an LSD radix sort (two
+// passes of 8 bits) sorts the keys in linear time. Both are stable, so
+// triangles with the same key keep the order they had last frame and do not
+// flicker between frames.
+///////////////////////////////////////////////////////////////////////////////
+
+static int sort_method = SORT_FRONT_TO_BACK;
+
+static uint16_t *keys = NULL;
+static int *order = NULL;
+static int *scratch_order = NULL;
+static triangle_t *scratch_triangles = NULL;
+static int capacity = 0;
+static int num_ordered = 0;
+
+void set_sort_method(int method) { sort_method = method; }
+
+bool is_sort_front_to_back(void) { return sort_method == SORT_FRONT_TO_BACK; }
+
+static uint16_t depth_key(const triangle_t *triangle) {
+  float depth =
+      triangle->points[0].w + triangle->points[1].w + triangle->points[2].w;
+  uint32_t bits;
+  memcpy(&bits, &depth, sizeof(bits));
+  return bits >> 16;
+}
+
+// Insertion sort order by key, giving up once more than max_moves triangles
+// had to be shifted. order is a permutation of the triangles either way
+static bool insertion_sort(int *order, int num_triangles, int max_moves) {
+  int moves = 0;
+  for (int i = 1; i < num_triangles; i++) {
+    int index = order[i];
+    uint16_t key = keys[index];
+    int j = i;
+    while (j > 0 && keys[order[j - 1]] > key) {
+      if (++moves > max_moves) {
+        order[j] = index;
+        return false;
+      }
+      order[j] = order[j - 1];
+      j--;
+    }
+    order[j] = index;
+  }
+  return true;
+}
+
+// LSD radix sort order by key, one byte at a time. After an even number of
+// passes the result ends up back in order
+static void radix_sort(int *order, int *scratch, int num_triangles) {
+  for (int shift = 0; shift < 16; shift += 8) {
+    int offsets[256] = {0};
+    for (int i = 0; i < num_triangles; i++) {
+      offsets[(keys[order[i]] >> shift) & 0xFF]++;
+    }
+    int start = 0;
+    for (int digit = 0; digit < 256; digit++) {
+      int count = offsets[digit];
+      offsets[digit] = start;
+      start += count;
+    }
+    for (int i = 0; i < num_triangles; i++) {
+      scratch[offsets[(keys[order[i]] >> shift) & 0xFF]++] = order[i];
+    }
+
+    int *swap = order;
+    order = scratch;
+    scratch = swap;
+  }
+}
+
+void sort_triangles_front_to_back(triangle_t *triangles, int num_triangles) {
+  if (num_triangles > capacity) {
+    capacity = num_triangles;
+    keys = (uint16_t *)realloc(keys, sizeof(uint16_t) * capacity);
+    order = (int *)realloc(order, sizeof(int) * capacity);
+    scratch_order = (int *)realloc(scratch_order, sizeof(int) * capacity);
+    scratch_triangles =
+        (triangle_t *)realloc(scratch_triangles, sizeof(triangle_t) * capacity);
+  }
+
+  // The triangle list is rebuilt from the meshes every frame, so index i is
+  // the same face as last frame unless faces were clipped or culled in or out
+  if (num_triangles != num_ordered) {
+    for (int i = 0; i < num_triangles; i++) {
+      order[i] = i;
+    }
+    num_ordered = num_triangles;
+  }
+
+  for (int i = 0; i < num_triangles; i++) {
+    keys[i] = depth_key(&triangles[i]);
+  }
+  if (!insertion_sort(order, num_triangles, num_triangles)) {
+    radix_sort(order, scratch_order, num_triangles);
+  }
+
+  for (int i = 0; i < num_triangles; i++) {
+    scratch_triangles[i] = triangles[order[i]];
+  }
+  memcpy(triangles, scratch_triangles, sizeof(triangle_t) * num_triangles);
+}
+
+void destroy_sort(void) {
+  free(keys);
+  keys = NULL;
+  free(order);
+  order = NULL;
+  free(scratch_order);
+  scratch_order = NULL;
+  free(scratch_triangles);
+  scratch_triangles = NULL;
+  capacity = 0;
+  num_ordered = 0;
+}
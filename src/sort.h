@@ -0,0 +1,33 @@
+#ifndef SORT_H
+#define SORT_H
+
+#include "triangle.h"
+#include <stdbool.h>
+
+enum sort_method { SORT_NONE, SORT_FRONT_TO_BACK };
+
+/**
+ * enable or disable front to back sorting of the triangles to render
+ */
+void set_sort_method(int method);
+
+/**
+ * check if front to back sorting is enabled
+ */
+bool is_sort_front_to_back(void);
+
+/**
+ * Reorder projected triangles roughly front to back by view depth, so the
+ * nearest ones fill the depth buffer first and the ones behind them are
+ * rejected before any pixel of them is drawn. The sort is linear time and
+ * starts from the order it left the triangles in last frame, which is usually
+ * close to sorted already
+ *
+ * @param  triangles: projected triangles, sorted in place
+ * @param  num_triangles: number of triangles
+ */
+void sort_triangles_front_to_back(triangle_t *triangles, int num_triangles);
+
+void destroy_sort(void);
+
+#endif
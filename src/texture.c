@@ -1,6 +1,170 @@
 #include "texture.h"
+#include <stddef.h>
+#include <stdlib.h>
 
 tex2_t tex2_clone(tex2_t *t) {
   tex2_t result = {t->u, t->v};
   return result;
 }
+
+static bool is_power_of_two(int n) { return n > 0 && (n & (n - 1)) == 0; }
+
+/**
+ * Copy row-major texels into tiles (see TEXTURE_TILE_SIZE) in memory of their
+ * own, aligned so every tile is exactly one cache line. The texels are NULL if
+ * the memory could not be allocated
+ */
+static texture_t texture_tiled_copy(const uint32_t *texels, int width,
+                                    int height) {
+  texture_t texture = {.width = width, .height = height};
+  int tile_bytes = sizeof(uint32_t) * TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE;
+  void *memory = malloc(sizeof(uint32_t) * width * height + tile_bytes - 1);
+  if (memory == NULL) {
+    return texture;
+  }
+  uint32_t *tiled = (uint32_t *)(((uintptr_t)memory + tile_bytes - 1) &
+                                 ~(uintptr_t)(tile_bytes - 1));
+
+  int width_shift = 0;
+  while ((1 << width_shift) < width) {
+    width_shift++;
+  }
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      int index = ((y & ~3) << width_shift) + (((x & ~3) | (y & 3)) << 2) +
+                  (x & 3);
+      tiled[index] = texels[width * y + x];
+    }
+  }
+
+  texture.texels = tiled;
+  texture.tiled = true;
+  texture.width_shift = width_shift;
+  texture.tile_memory = memory;
+  return texture;
+}
+
+// Box filter: the rounded average of each 8 bit channel of four texels
+static uint32_t average_texels(uint32_t a, uint32_t b, uint32_t c,
+                               uint32_t d) {
+  uint32_t result = 0;
+  for (int shift = 0; shift < 32; shift += 8) {
+    uint32_t sum = ((a >> shift) & 0xFF) + ((b >> shift) & 0xFF) +
+                   ((c >> shift) & 0xFF) + ((d >> shift) & 0xFF);
+    result |= ((sum + 2) / 4) << shift;
+  }
+  return result;
+}
+
+/**
+ * Build the mip chain of a tiled texture from its row-major texels, halving
+ * the size with a box filter until the shorter side is TEXTURE_TILE_SIZE
+ */
+static void texture_build_mips(texture_t *texture, const uint32_t *texels) {
+  int num_mips = 0;
+  for (int width = texture->width, height = texture->height;
+       width > TEXTURE_TILE_SIZE && height > TEXTURE_TILE_SIZE;
+       width /= 2, height /= 2) {
+    num_mips++;
+  }
+  if (num_mips == 0) {
+    return;
+  }
+  texture->mips = (texture_t *)calloc(num_mips, sizeof(texture_t));
+  if (texture->mips == NULL) {
+    return;
+  }
+
+  // Each level is filtered from the row-major texels of the one before it and
+  // only then tiled, so the previous row-major level can go
+  const uint32_t *source = texels;
+  uint32_t *filtered = NULL;
+  int width = texture->width;
+  int height = texture->height;
+  for (int level = 0; level < num_mips; level++) {
+    int mip_width = width / 2;
+    int mip_height = height / 2;
+    uint32_t *mip = (uint32_t *)malloc(sizeof(uint32_t) * mip_width *
+                                       mip_height);
+    if (mip == NULL) {
+      break;
+    }
+    for (int y = 0; y < mip_height; y++) {
+      const uint32_t *row = &source[width * 2 * y];
+      for (int x = 0; x < mip_width; x++) {
+        mip[mip_width * y + x] =
+            average_texels(row[2 * x], row[2 * x + 1], row[width + 2 * x],
+                           row[width + 2 * x + 1]);
+      }
+    }
+    free(filtered);
+    filtered = mip;
+    source = mip;
+    width = mip_width;
+    height = mip_height;
+
+    texture->mips[level] = texture_tiled_copy(mip, mip_width, mip_height);
+    if (texture->mips[level].texels == NULL) {
+      break;
+    }
+    texture->num_mips = level + 1;
+  }
+  free(filtered);
+}
+
+/**
+ * Build a texture descriptor for a decoded PNG image. Textures whose size
+ * allows it are converted to tiles with a mip chain, and the PNG is let go
+ */
+texture_t texture_from_png(upng_t *png) {
+  texture_t texture = {.png = png,
+                       .texels = (uint32_t *)upng_get_buffer(png),
+                       .width = upng_get_width(png),
+                       .height = upng_get_height(png)};
+  if (is_power_of_two(texture.width) && is_power_of_two(texture.height) &&
+      texture.width >= TEXTURE_TILE_SIZE &&
+      texture.height >= TEXTURE_TILE_SIZE) {
+    texture_t tiled =
+        texture_tiled_copy(texture.texels, texture.width, texture.height);
+    if (tiled.texels != NULL) {
+      texture_build_mips(&tiled, texture.texels);
+      upng_free(png);
+      texture = tiled;
+    }
+  }
+  return texture;
+}
+
+/**
+ * Mip level of a texture, 0 being the texture itself. Levels past the end of
+ * the mip chain give its smallest level
+ */
+texture_t *texture_mip_level(texture_t *texture, int level) {
+  if (level <= 0 || texture->num_mips == 0) {
+    return texture;
+  }
+  if (level > texture->num_mips) {
+    level = texture->num_mips;
+  }
+  return &texture->mips[level - 1];
+}
+
+/**
+ * Free the PNG image or the tiles and mip chain backing a texture descriptor
+ */
+void texture_free(texture_t *texture) {
+  if (texture->png != NULL) {
+    upng_free(texture->png);
+  }
+  for (int level = 0; level < texture->num_mips; level++) {
+    free(texture->mips[level].tile_memory);
+  }
+  free(texture->mips);
+  free(texture->tile_memory);
+  texture->png = NULL;
+  texture->texels = NULL;
+  texture->tile_memory = NULL;
+  texture->tiled = false;
+  texture->mips = NULL;
+  texture->num_mips = 0;
+}
@@ -1,11 +1,49 @@
 #ifndef TEXTURE_H
 #define TEXTURE_H
 
+#include "upng.h"
+#include <stdbool.h>
+#include <stdint.h>
+
 typedef struct {
   float u;
   float v;
 } tex2_t;
 
+// Textures that are a power of two and at least TEXTURE_TILE_SIZE texels in
+// both directions are rearranged at load time into square tiles of
+// TEXTURE_TILE_SIZE x TEXTURE_TILE_SIZE texels, 64 bytes each, so one cache
+// line holds a small 2D patch of texels instead of a sliver of one row. The
+// tiles are stored row by row and the texels within a tile row by row too, so
+// texel (x, y) of a tiled texture is at
+//
+//   ((y & ~3) << width_shift) + (((x & ~3) | (y & 3)) << 2) + (x & 3)
+//
+// A triangle seen at an angle walks its texture diagonally, which with
+// row-major texels touches a new cache line on almost every pixel
+#define TEXTURE_TILE_SIZE 4
+
+// texture_t caches everything the rasterizer needs to sample a decoded PNG so
+// we don't have to query upng for the dimensions and buffer on every texel.
+// Tiled textures also carry a mip chain: every level is a texture_t of its own
+// at half the size of the one before, down to TEXTURE_TILE_SIZE on the shorter
+// side, with each texel the average of the 2x2 texels it covers one level up
+typedef struct texture {
+  upng_t *png;      // decoded PNG that owns the texel memory, until tiled
+  uint32_t *texels; // RGBA texels (NULL if no texture is loaded)
+  int width;
+  int height;
+  bool tiled;        // texels are in tiles rather than row-major
+  int width_shift;   // log2(width) for tiled textures
+  void *tile_memory; // allocation the tiled texels live in
+  struct texture *mips; // levels 1 to num_mips, smallest last
+  int num_mips;
+} texture_t;
+
 tex2_t tex2_clone(tex2_t *t);
 
+texture_t texture_from_png(upng_t *png);
+texture_t *texture_mip_level(texture_t *texture, int level);
+void texture_free(texture_t *texture);
+
 #endif
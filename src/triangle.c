@@ -1,6 +1,9 @@
 #include "triangle.h"
 #include "display.h"
 #include "swap.h"
+#include "triangle_simd.h"
+#include <math.h>
+#include <stdbool.h>
 
 /**
  * Return the barycentric weights alpha, beta, and gamma for point p
@@ -56,191 +59,87 @@ void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2,
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Function to draw a solid pixel at position (x,y) using depth interpolation
+// Function to draw a solid pixel using the depth interpolated for it. Returns
+// whether the pixel passed the depth test and was drawn
 ///////////////////////////////////////////////////////////////////////////////
-void draw_triangle_pixel(int x, int y, uint32_t color, vec4_t point_a,
-                         vec4_t point_b, vec4_t point_c) {
-  // Create three vec2 to find the interpolation
-  vec2_t p = {x, y};
-  vec2_t a = vec2_from_vec4(point_a);
-  vec2_t b = vec2_from_vec4(point_b);
-  vec2_t c = vec2_from_vec4(point_c);
-
-  // Calculate the barycentric coordinates of our point 'p' inside the triangle
-  vec3_t weights = barycentric_weights(a, b, c, p);
-
-  float alpha = weights.x;
-  float beta = weights.y;
-  float gamma = weights.z;
-
-  // Interpolate the value of 1/w for the current pixel
-  float interpolated_reciprocal_w = (1 / point_a.w) * alpha +
-                                    (1 / point_b.w) * beta +
-                                    (1 / point_c.w) * gamma;
-
+bool draw_triangle_pixel(uint32_t *pixel, float *depth,
+                         const triangle_setup_t *setup,
+                         float interpolated_reciprocal_w) {
   // Adjust 1/w so the pixels that are closer to the camera have smaller values
-  interpolated_reciprocal_w = 1.0 - interpolated_reciprocal_w;
+  float pixel_depth = 1.0 - interpolated_reciprocal_w;
 
   // Only draw the pixel if the depth value is less than the one previously
   // stored in the z-buffer
-  if (interpolated_reciprocal_w < get_zbuffer_at(x, y)) {
-    // Draw a pixel at position (x,y) with a solid color
-    draw_pixel(x, y, color);
+  if (pixel_depth < *depth) {
+    // Draw the pixel with a solid color
+    *pixel = setup->color;
 
     // Update the z-buffer value with the 1/w of this current pixel
-    set_zbuffer_at(x, y, interpolated_reciprocal_w);
-  }
-}
-
-void draw_filled_triangle(int x0, int y0, float z0, float w0, int x1, int y1,
-                          float z1, float w1, int x2, int y2, float z2,
-                          float w2, uint32_t color) {
-  // We need to sort the vertices by y-coordinate ascending (y0 < y1 < y2)
-  if (y0 > y1) {
-    int_swap(&y0, &y1);
-    int_swap(&x0, &x1);
-    float_swap(&z0, &z1);
-    float_swap(&w0, &w1);
-  }
-  if (y1 > y2) {
-    int_swap(&y1, &y2);
-    int_swap(&x1, &x2);
-    float_swap(&z1, &z2);
-    float_swap(&w1, &w2);
-  }
-  if (y0 > y1) {
-    int_swap(&y0, &y1);
-    int_swap(&x0, &x1);
-    float_swap(&z0, &z1);
-    float_swap(&w0, &w1);
-  }
-
-  // Create three vector points after we sort the vertices
-  vec4_t point_a = {x0, y0, z0, w0};
-  vec4_t point_b = {x1, y1, z1, w1};
-  vec4_t point_c = {x2, y2, z2, w2};
-
-  ///////////////////////////////////////////////////////
-  // Render the upper part of the triangle (flat-bottom)
-  ///////////////////////////////////////////////////////
-  float inv_slope_1 = 0;
-  float inv_slope_2 = 0;
-
-  if (y1 - y0 != 0)
-    inv_slope_1 = (float)(x1 - x0) / abs(y1 - y0);
-  if (y2 - y0 != 0)
-    inv_slope_2 = (float)(x2 - x0) / abs(y2 - y0);
-
-  if (y1 - y0 != 0) {
-    for (int y = y0; y <= y1; y++) {
-      int x_start = x1 + (y - y1) * inv_slope_1;
-      int x_end = x0 + (y - y0) * inv_slope_2;
-
-      if (x_end < x_start) {
-        int_swap(&x_start, &x_end); // swap if x_start is to the right of x_end
-      }
-
-      for (int x = x_start; x < x_end; x++) {
-        // Draw our pixel with a solid color
-        draw_triangle_pixel(x, y, color, point_a, point_b, point_c);
-      }
-    }
-  }
-
-  ///////////////////////////////////////////////////////
-  // Render the bottom part of the triangle (flat-top)
-  ///////////////////////////////////////////////////////
-  inv_slope_1 = 0;
-  inv_slope_2 = 0;
-
-  if (y2 - y1 != 0)
-    inv_slope_1 = (float)(x2 - x1) / abs(y2 - y1);
-  if (y2 - y0 != 0)
-    inv_slope_2 = (float)(x2 - x0) / abs(y2 - y0);
-
-  if (y2 - y1 != 0) {
-    for (int y = y1; y <= y2; y++) {
-      int x_start = x1 + (y - y1) * inv_slope_1;
-      int x_end = x0 + (y - y0) * inv_slope_2;
-
-      if (x_end < x_start) {
-        int_swap(&x_start, &x_end); // swap if x_start is to the right of x_end
-      }
-
-      for (int x = x_start; x < x_end; x++) {
-        // Draw our pixel with a solid color
-        draw_triangle_pixel(x, y, color, point_a, point_b, point_c);
-      }
-    }
+    *depth = pixel_depth;
+    return true;
   }
+  return false;
 }
 
 /**
- * Draw the textured pixel at position x and y using interpolation
+ * Fetch the texel at the perspective correct UV coordinate of a pixel, given
+ * the values of 1/w, u/w and v/w interpolated for it
  **/
-void draw_texel(int x, int y, upng_t *texture, vec4_t point_a, vec4_t point_b,
-                vec4_t point_c, tex2_t a_uv, tex2_t b_uv, tex2_t c_uv) {
-  vec2_t p = {x, y};
-  vec2_t a = vec2_from_vec4(point_a);
-  vec2_t b = vec2_from_vec4(point_b);
-  vec2_t c = vec2_from_vec4(point_c);
-
-  vec3_t weights = barycentric_weights(a, b, c, p);
-
-  float alpha = weights.x;
-  float beta = weights.y;
-  float gamma = weights.z;
-
-  // Variables to store the interpolated values of U, V, and also 1/w for the
-  // current pixel
-  float interpolated_u;
-  float interpolated_v;
-  float interpolated_reciprocal_w;
-
-  // Perform the interpolation of all U/w and V/w values using barycentric
-  // weights and a factor of 1/w
-  interpolated_u = (a_uv.u / point_a.w) * alpha + (b_uv.u / point_b.w) * beta +
-                   (c_uv.u / point_c.w) * gamma;
-  interpolated_v = (a_uv.v / point_a.w) * alpha + (b_uv.v / point_b.w) * beta +
-                   (c_uv.v / point_c.w) * gamma;
-
-  // Also interpolate the value of 1/w for the current pixel
-  interpolated_reciprocal_w = (1 / point_a.w) * alpha + (1 / point_b.w) * beta +
-                              (1 / point_c.w) * gamma;
-
+static uint32_t sample_texture(const texture_t *texture,
+                               float interpolated_reciprocal_w,
+                               float interpolated_u_over_w,
+                               float interpolated_v_over_w) {
   // Now we can divide back both interpolated values by 1/w
-  interpolated_u /= interpolated_reciprocal_w;
-  interpolated_v /= interpolated_reciprocal_w;
-
-  // get texture dimenions
-  int texture_width = upng_get_width(texture);
-  int texture_height = upng_get_height(texture);
-  ;
+  float interpolated_w = 1.0 / interpolated_reciprocal_w;
+  float interpolated_u = interpolated_u_over_w * interpolated_w;
+  float interpolated_v = interpolated_v_over_w * interpolated_w;
 
   // Map the UV coordinate to the full texture width and height
+  int tex_x = (int)(interpolated_u * texture->width);
+  int tex_y = (int)(interpolated_v * texture->height);
+
+  // Tiled textures are a power of two in size, so wrapping the texel
+  // coordinates around is just a mask
+  if (texture->tiled) {
+    tex_x &= texture->width - 1;
+    tex_y &= texture->height - 1;
+    return texture->texels[((tex_y & ~3) << texture->width_shift) +
+                           (((tex_x & ~3) | (tex_y & 3)) << 2) + (tex_x & 3)];
+  }
+
   // Truncating within the allocated dimensions at the end of these lines is a
   // messy hack to make sure we are not trying to write to a value outside of
   // allocated memory GPU's take care of this using Fill Convention. We are
   // doing it the old fashioned way Note that this may result in some 'tears'
   // between faces
-  int tex_x = abs((int)(interpolated_u * texture_width)) % texture_width;
-  int tex_y = abs((int)(interpolated_v * texture_height)) % texture_height;
+  tex_x = abs(tex_x) % texture->width;
+  tex_y = abs(tex_y) % texture->height;
+  return texture->texels[(texture->width * tex_y) + tex_x];
+}
 
+/**
+ * Draw the textured pixel using the values of 1/w, u/w and v/w interpolated
+ * for it. Returns whether the pixel passed the depth test and was drawn
+ **/
+bool draw_texel(uint32_t *pixel, float *depth, const triangle_setup_t *setup,
+                float interpolated_reciprocal_w, float interpolated_u_over_w,
+                float interpolated_v_over_w) {
   // invert 1/w so pixels that are closer to cam have smaller values
-  interpolated_reciprocal_w = 1.0 - interpolated_reciprocal_w;
-
-  // As long as the current pixel is in front of what is there currently
-  // (i.e., depth value of this pixel is LESS than the one previously stored in
-  // z-buffer)...
-  if (interpolated_reciprocal_w < get_zbuffer_at(x, y)) {
-    // get buffer of colors from the texture
-    uint32_t *texture_buffer = (uint32_t *)upng_get_buffer(texture);
-    // ...draw the pixel
-    draw_pixel(x, y, texture_buffer[(texture_width * tex_y) + tex_x]);
-    // ... and update the z-buffer value with the 1/w (1 / old z in camera
-    // space) of this current pixel
-    set_zbuffer_at(x, y, interpolated_reciprocal_w);
+  float pixel_depth = 1.0 - interpolated_reciprocal_w;
+
+  // Test the depth first: a pixel hidden behind what is already in the
+  // z-buffer doesn't need any UV math or texture fetch at all
+  if (pixel_depth >= *depth) {
+    return false;
   }
+
+  // ...draw the pixel
+  *pixel = sample_texture(setup->texture, interpolated_reciprocal_w,
+                          interpolated_u_over_w, interpolated_v_over_w);
+  // ... and update the z-buffer value with the 1/w (1 / old z in camera
+  // space) of this current pixel
+  *depth = pixel_depth;
+  return true;
 }
 
 // AFFINE MAPPING (draw texel()):
@@ -276,102 +175,625 @@ texture_height); draw_pixel(x, y, texture[texIndex]);
 }
 */
 
-void draw_textured_triangle(int x0, int y0, float z0, float w0, float u0,
-                            float v0, int x1, int y1, float z1, float w1,
-                            float u1, float v1, int x2, int y2, float z2,
-                            float w2, float u2, float v2, upng_t *texture) {
-  // We need to sort the vertices by y-coordinate ascending (y0 < y1 < y2)
-  if (y0 > y1) {
-    int_swap(&y0, &y1);
-    int_swap(&x0, &x1);
-    float_swap(&z0, &z1);
-    float_swap(&w0, &w1);
-    float_swap(&u0, &u1);
-    float_swap(&v0, &v1);
+///////////////////////////////////////////////////////////////////////////////
+// Edge functions
+///////////////////////////////////////////////////////////////////////////////
+// The edge function of A->B is the cross product (B - A) x (P - A). It is zero
+// for points on the edge and has opposite signs on either side of it, so P is
+// inside the triangle when all three edge functions agree in sign. These are
+// the same sub-triangle areas barycentric_weights() computes, but since they
+// are affine in x and y we only evaluate them once, at the top-left corner of
+// the triangle's bounding box, and then walk the box using nothing but adds.
+//
+// Coverage uses them in 28.4 fixed point, sampled at pixel centers. Pixels
+// exactly on an edge follow the top-left fill rule: they belong to the
+// triangle if the edge is a top edge (horizontal, with the triangle below it)
+// or a left edge (the triangle is to its right). Their neighbour across a
+// shared edge sees it as a bottom or right edge, so no pixel is drawn twice
+// and none is missed.
+///////////////////////////////////////////////////////////////////////////////
+static int min3(int a, int b, int c) {
+  int min = a < b ? a : b;
+  return min < c ? min : c;
+}
+
+static int max3(int a, int b, int c) {
+  int max = a > b ? a : b;
+  return max > c ? max : c;
+}
+
+static edge_t edge_setup_fixed(int a_x, int a_y, int b_x, int b_y,
+                               int origin_x, int origin_y) {
+  int64_t edge_x = b_x - a_x;
+  int64_t edge_y = b_y - a_y;
+  edge_t edge = {.value = edge_x * (origin_y - a_y) - edge_y * (origin_x - a_x),
+                 .dx = -edge_y * SUBPIXEL_ONE,
+                 .dy = edge_x * SUBPIXEL_ONE};
+
+  // For triangles wound clockwise on screen (y points down) the inside is
+  // where the edge function is positive. Top and left edges keep the points on
+  // them, every other edge drops them by needing a value of at least 1
+  bool is_top_edge = edge_y == 0 && edge_x > 0;
+  bool is_left_edge = edge_y < 0;
+  if (!is_top_edge && !is_left_edge) {
+    edge.value -= 1;
   }
-  if (y1 > y2) {
-    int_swap(&y1, &y2);
-    int_swap(&x1, &x2);
-    float_swap(&z1, &z2);
-    float_swap(&w1, &w2);
-    float_swap(&u1, &u2);
-    float_swap(&v1, &v2);
+  return edge;
+}
+
+// The same edge function in floating point (in pixels), used for the
+// barycentric weights that attributes are interpolated with
+static gradient_t edge_setup(vec2_t a, vec2_t b, vec2_t origin) {
+  gradient_t edge = {.value = (b.x - a.x) * (origin.y - a.y) -
+                              (b.y - a.y) * (origin.x - a.x),
+                     .dx = a.y - b.y,
+                     .dy = b.x - a.x};
+  return edge;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Attribute plane equations
+///////////////////////////////////////////////////////////////////////////////
+// Anything that is linear in screen space can be written as the barycentric
+// blend of its three vertex values. Since the weights themselves are linear
+// gradients, so is the blend, and we can fold the vertex values into a single
+// value at the origin plus a d/dx and a d/dy once per triangle. 1/w, u/w and
+// v/w are all linear in screen space (that's the whole point of dividing by w
+// for perspective correct texturing), so they get one of these each.
+///////////////////////////////////////////////////////////////////////////////
+static gradient_t gradient_setup(const gradient_t weights[3], float value_a,
+                                 float value_b, float value_c) {
+  gradient_t gradient = {
+      .value = weights[0].value * value_a + weights[1].value * value_b +
+               weights[2].value * value_c,
+      .dx = weights[0].dx * value_a + weights[1].dx * value_b +
+            weights[2].dx * value_c,
+      .dy = weights[0].dy * value_a + weights[1].dy * value_b +
+            weights[2].dy * value_c};
+  return gradient;
+}
+
+/**
+ * Pick the mip level of a texture for a whole triangle from how many texels
+ * it maps onto each pixel: the ratio between the area it covers in the
+ * texture and its area on screen (area is twice that, in fixed point). Every
+ * level halves the texels per pixel in both directions, so the level is half
+ * the log2 of that ratio, rounded to the nearest level
+ **/
+static int mip_level(const texture_t *texture, tex2_t a_uv, tex2_t b_uv,
+                     tex2_t c_uv, int64_t area) {
+  if (texture->num_mips == 0) {
+    return 0;
   }
-  if (y0 > y1) {
-    int_swap(&y0, &y1);
-    int_swap(&x0, &x1);
-    float_swap(&z0, &z1);
-    float_swap(&w0, &w1);
-    float_swap(&u0, &u1);
-    float_swap(&v0, &v1);
+  float texel_area = fabsf((b_uv.u - a_uv.u) * (c_uv.v - a_uv.v) -
+                           (c_uv.u - a_uv.u) * (b_uv.v - a_uv.v)) *
+                     texture->width * texture->height;
+  float pixel_area = (float)area / (SUBPIXEL_ONE * SUBPIXEL_ONE);
+  if (texel_area <= pixel_area) {
+    return 0;
   }
+  return (int)(0.5f * log2f(texel_area / pixel_area) + 0.5f);
+}
 
-  // Flip the V component to account for inverted UV-coordinates (V grows
-  // downwards)
-  v0 = 1.0 - v0;
-  v1 = 1.0 - v1;
-  v2 = 1.0 - v2;
+/**
+ * Prepare a projected triangle for rasterization: snap it to fixed point and
+ * compute its screen bounding box clamped to the window, its edge functions
+ * and the gradients of 1/w, u/w and v/w, and the mip level of its texture to
+ * sample. Returns false if the triangle covers no pixels
+ **/
+bool setup_triangle(triangle_setup_t *setup, vec4_t point_a, vec4_t point_b,
+                    vec4_t point_c, tex2_t a_uv, tex2_t b_uv, tex2_t c_uv,
+                    texture_t *texture, uint32_t color) {
+  // Snap the screen positions to 28.4 fixed point
+  int a_x = lrintf(point_a.x * SUBPIXEL_ONE);
+  int a_y = lrintf(point_a.y * SUBPIXEL_ONE);
+  int b_x = lrintf(point_b.x * SUBPIXEL_ONE);
+  int b_y = lrintf(point_b.y * SUBPIXEL_ONE);
+  int c_x = lrintf(point_c.x * SUBPIXEL_ONE);
+  int c_y = lrintf(point_c.y * SUBPIXEL_ONE);
+
+  // Twice the signed area of ABC. Its sign tells us the winding of the
+  // triangle on screen, and a zero area triangle has no pixels to draw
+  int64_t area = (int64_t)(b_x - a_x) * (c_y - a_y) -
+                 (int64_t)(b_y - a_y) * (c_x - a_x);
+  if (area == 0) {
+    return false;
+  }
 
-  // Create vector points and texture coords after we sort the vertices
-  vec4_t point_a = {x0, y0, z0, w0};
-  vec4_t point_b = {x1, y1, z1, w1};
-  vec4_t point_c = {x2, y2, z2, w2};
-  tex2_t a_uv = {u0, v0};
-  tex2_t b_uv = {u1, v1};
-  tex2_t c_uv = {u2, v2};
+  // Make the winding clockwise on screen (positive area) by swapping B and C,
+  // so the inside is always where the edge functions are positive
+  if (area < 0) {
+    area = -area;
+    int_swap(&b_x, &c_x);
+    int_swap(&b_y, &c_y);
+    vec4_t point = point_b;
+    point_b = point_c;
+    point_c = point;
+    tex2_t uv = b_uv;
+    b_uv = c_uv;
+    c_uv = uv;
+  }
 
-  ///////////////////////////////////////////////////////
-  // Render the upper part of the triangle (flat-bottom)
-  ///////////////////////////////////////////////////////
-  float inv_slope_1 = 0;
-  float inv_slope_2 = 0;
+  // Bounding box of the pixels whose centers (x + 0.5, y + 0.5) can be
+  // inside the triangle, clamped to the visible window. This is the scissor
+  // that trims faces guard band clipping left hanging over the window edges
+  int half_pixel = SUBPIXEL_ONE / 2;
+  setup->min_x =
+      ceilf((float)(min3(a_x, b_x, c_x) - half_pixel) / SUBPIXEL_ONE);
+  setup->min_y =
+      ceilf((float)(min3(a_y, b_y, c_y) - half_pixel) / SUBPIXEL_ONE);
+  setup->max_x =
+      floorf((float)(max3(a_x, b_x, c_x) - half_pixel) / SUBPIXEL_ONE);
+  setup->max_y =
+      floorf((float)(max3(a_y, b_y, c_y) - half_pixel) / SUBPIXEL_ONE);
+  if (setup->min_x < 0)
+    setup->min_x = 0;
+  if (setup->min_y < 0)
+    setup->min_y = 0;
+  if (setup->max_x > get_window_width() - 1)
+    setup->max_x = get_window_width() - 1;
+  if (setup->max_y > get_window_height() - 1)
+    setup->max_y = get_window_height() - 1;
+  if (setup->min_x > setup->max_x || setup->min_y > setup->max_y) {
+    return false;
+  }
 
-  if (y1 - y0 != 0)
-    inv_slope_1 = (float)(x1 - x0) / abs(y1 - y0);
-  if (y2 - y0 != 0)
-    inv_slope_2 = (float)(x2 - x0) / abs(y2 - y0);
+  // Set up the three edge functions at the center of the first pixel. Edge BC
+  // measures the weight of A (alpha), CA the weight of B (beta) and AB the
+  // weight of C (gamma)
+  int origin_x = setup->min_x * SUBPIXEL_ONE + half_pixel;
+  int origin_y = setup->min_y * SUBPIXEL_ONE + half_pixel;
+  setup->edges[0] = edge_setup_fixed(b_x, b_y, c_x, c_y, origin_x, origin_y);
+  setup->edges[1] = edge_setup_fixed(c_x, c_y, a_x, a_y, origin_x, origin_y);
+  setup->edges[2] = edge_setup_fixed(a_x, a_y, b_x, b_y, origin_x, origin_y);
+
+  // Scaling the edges by 1/area turns them straight into barycentric weights.
+  // They are taken from the snapped positions so the attributes line up with
+  // the pixels that are actually covered
+  vec2_t a = {(float)a_x / SUBPIXEL_ONE, (float)a_y / SUBPIXEL_ONE};
+  vec2_t b = {(float)b_x / SUBPIXEL_ONE, (float)b_y / SUBPIXEL_ONE};
+  vec2_t c = {(float)c_x / SUBPIXEL_ONE, (float)c_y / SUBPIXEL_ONE};
+  vec2_t origin = {setup->min_x + 0.5, setup->min_y + 0.5};
+  gradient_t weights[3] = {edge_setup(b, c, origin), edge_setup(c, a, origin),
+                           edge_setup(a, b, origin)};
+  float inv_area = (float)(SUBPIXEL_ONE * SUBPIXEL_ONE) / area;
+  for (int i = 0; i < 3; i++) {
+    weights[i].value *= inv_area;
+    weights[i].dx *= inv_area;
+    weights[i].dy *= inv_area;
+  }
 
-  if (y1 - y0 != 0) {
-    for (int y = y0; y <= y1; y++) {
-      int x_start = x1 + (y - y1) * inv_slope_1;
-      int x_end = x0 + (y - y0) * inv_slope_2;
+  // Fold the vertex values of 1/w, u/w and v/w into their gradients
+  float reciprocal_w_a = 1 / point_a.w;
+  float reciprocal_w_b = 1 / point_b.w;
+  float reciprocal_w_c = 1 / point_c.w;
+  setup->reciprocal_w =
+      gradient_setup(weights, reciprocal_w_a, reciprocal_w_b, reciprocal_w_c);
+  setup->u_over_w = gradient_setup(weights, a_uv.u * reciprocal_w_a,
+                                   b_uv.u * reciprocal_w_b,
+                                   c_uv.u * reciprocal_w_c);
+  setup->v_over_w = gradient_setup(weights, a_uv.v * reciprocal_w_a,
+                                   b_uv.v * reciprocal_w_b,
+                                   c_uv.v * reciprocal_w_c);
+
+  // The nearest depth anywhere on the triangle is at the vertex with the
+  // largest 1/w, since 1/w varies linearly across it
+  setup->min_depth =
+      1.0 - fmaxf(reciprocal_w_a, fmaxf(reciprocal_w_b, reciprocal_w_c));
+
+  setup->texture = NULL;
+  if (texture != NULL && texture->texels != NULL) {
+    setup->texture = texture_mip_level(
+        texture, mip_level(texture, a_uv, b_uv, c_uv, area));
+  }
+  setup->color = color;
+  return true;
+}
 
-      if (x_end < x_start) {
-        int_swap(&x_start, &x_end); // swap if x_start is to the right of x_end
-      }
+// Value of a gradient offset_x pixels right and offset_y pixels down from the
+// setup origin
+static float gradient_at(const gradient_t *gradient, float offset_x,
+                         float offset_y) {
+  return gradient->value + gradient->dx * offset_x + gradient->dy * offset_y;
+}
 
-      for (int x = x_start; x < x_end; x++) {
-        // Draw our pixel with the color that comes from the texture
-        draw_texel(x, y, texture, point_a, point_b, point_c, a_uv, b_uv, c_uv);
-      }
+///////////////////////////////////////////////////////////////////////////////
+// Scalar span kernels: step the interpolants one pixel at a time
+///////////////////////////////////////////////////////////////////////////////
+bool draw_filled_span(const triangle_setup_t *setup, const span_t *span,
+                      uint32_t *color_row, float *depth_row) {
+  int32_t w0 = span->edges[0];
+  int32_t w1 = span->edges[1];
+  int32_t w2 = span->edges[2];
+  float reciprocal_w = span->reciprocal_w;
+  bool was_inside = false;
+  bool drew = false;
+
+  for (int x = span->x_start; x <= span->x_end; x++) {
+    if (w0 >= 0 && w1 >= 0 && w2 >= 0) {
+      drew |= draw_triangle_pixel(&color_row[x], &depth_row[x], setup,
+                                  reciprocal_w);
+      was_inside = true;
+    } else if (was_inside) {
+      // A triangle is convex, so once we leave it there is nothing more to
+      // draw on this row
+      break;
+    }
+    w0 += span->edge_dx[0];
+    w1 += span->edge_dx[1];
+    w2 += span->edge_dx[2];
+    reciprocal_w += setup->reciprocal_w.dx;
+  }
+  return drew;
+}
+
+bool draw_textured_span(const triangle_setup_t *setup, const span_t *span,
+                        uint32_t *color_row, float *depth_row) {
+  int32_t w0 = span->edges[0];
+  int32_t w1 = span->edges[1];
+  int32_t w2 = span->edges[2];
+  float reciprocal_w = span->reciprocal_w;
+  float u_over_w = span->u_over_w;
+  float v_over_w = span->v_over_w;
+  bool was_inside = false;
+  bool drew = false;
+
+  for (int x = span->x_start; x <= span->x_end; x++) {
+    if (w0 >= 0 && w1 >= 0 && w2 >= 0) {
+      drew |= draw_texel(&color_row[x], &depth_row[x], setup, reciprocal_w,
+                         u_over_w, v_over_w);
+      was_inside = true;
+    } else if (was_inside) {
+      break;
     }
+    w0 += span->edge_dx[0];
+    w1 += span->edge_dx[1];
+    w2 += span->edge_dx[2];
+    reciprocal_w += setup->reciprocal_w.dx;
+    u_over_w += setup->u_over_w.dx;
+    v_over_w += setup->v_over_w.dx;
+  }
+  return drew;
+}
+
+static span_kernel_t filled_span_kernel = draw_filled_span;
+static span_kernel_t textured_span_kernel = draw_textured_span;
+
+/**
+ * Pick the widest span kernels the CPU we are running on supports. The scalar
+ * kernels stay in place when there is no SIMD support at all
+ **/
+void init_span_kernels(void) {
+#if TRIANGLE_SIMD_X86
+  if (SDL_HasAVX2()) {
+    filled_span_kernel = draw_filled_span_avx2;
+    textured_span_kernel = draw_textured_span_avx2;
+  } else if (SDL_HasSSE2()) {
+    filled_span_kernel = draw_filled_span_sse2;
+    textured_span_kernel = draw_textured_span_sse2;
   }
+#endif
+}
 
-  ///////////////////////////////////////////////////////
-  // Render the bottom part of the triangle (flat-top)
-  ///////////////////////////////////////////////////////
-  inv_slope_1 = 0;
-  inv_slope_2 = 0;
+// Value of an edge function offset_x pixels right and offset_y pixels down
+// from the setup origin
+static int64_t edge_at(const edge_t *edge, int offset_x, int offset_y) {
+  return edge->value + (int64_t)edge->dx * offset_x +
+         (int64_t)edge->dy * offset_y;
+}
 
-  if (y2 - y1 != 0)
-    inv_slope_1 = (float)(x2 - x1) / abs(y2 - y1);
-  if (y2 - y0 != 0)
-    inv_slope_2 = (float)(x2 - x0) / abs(y2 - y0);
+// How far the value of an edge function rises above (or falls below) its
+// value at the top-left pixel of a rectangle that is width by height pixels
+// past it
+static int64_t edge_rise(const edge_t *edge, int width, int height) {
+  return (edge->dx > 0 ? (int64_t)edge->dx * width : 0) +
+         (edge->dy > 0 ? (int64_t)edge->dy * height : 0);
+}
 
-  if (y2 - y1 != 0) {
-    for (int y = y1; y <= y2; y++) {
-      int x_start = x1 + (y - y1) * inv_slope_1;
-      int x_end = x0 + (y - y0) * inv_slope_2;
+static int64_t edge_fall(const edge_t *edge, int width, int height) {
+  return (edge->dx < 0 ? (int64_t)edge->dx * width : 0) +
+         (edge->dy < 0 ? (int64_t)edge->dy * height : 0);
+}
 
-      if (x_end < x_start) {
-        int_swap(&x_start, &x_end); // swap if x_start is to the right of x_end
+/**
+ * Can the triangle cover any pixel center in the rectangle from min_x, min_y
+ * to max_x, max_y (inclusive)? Not when all of them are outside the same edge
+ **/
+bool triangle_overlaps_rect(const triangle_setup_t *setup, int min_x,
+                            int min_y, int max_x, int max_y) {
+  for (int i = 0; i < 3; i++) {
+    const edge_t *edge = &setup->edges[i];
+    int64_t inside_most =
+        edge_at(edge, min_x - setup->min_x, min_y - setup->min_y) +
+        edge_rise(edge, max_x - min_x, max_y - min_y);
+    if (inside_most < 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Draw the rows y_start to y_end of a run of neighbouring blocks, from x_start
+// to x_end, into color_buffer (which is window sized) and refresh the farthest
+// depth of the blocks if anything was drawn
+static bool draw_block_run(const triangle_setup_t *setup, span_kernel_t kernel,
+                           uint32_t *color_buffer, int x_start, int y_start,
+                           int x_end, int y_end) {
+  int window_width = get_window_width();
+  float *z_buffer = get_z_buffer();
+
+  int offset_x = x_start - setup->min_x;
+  int offset_y = y_start - setup->min_y;
+  span_t span = {.x_start = x_start, .x_end = x_end};
+
+  // An edge that crosses the run takes at most one run width and height of
+  // steps to get from zero to any of its pixels, so its value fits in 32 bits
+  // relative to the run. An edge with the whole run inside of it doesn't need
+  // testing at all
+  int32_t edge_dy[3];
+  for (int i = 0; i < 3; i++) {
+    const edge_t *edge = &setup->edges[i];
+    int64_t value = edge_at(edge, offset_x, offset_y);
+    if (value + edge_fall(edge, x_end - x_start, y_end - y_start) >= 0) {
+      span.edges[i] = 0;
+      span.edge_dx[i] = 0;
+      edge_dy[i] = 0;
+    } else {
+      span.edges[i] = value;
+      span.edge_dx[i] = edge->dx;
+      edge_dy[i] = edge->dy;
+    }
+  }
+  span.reciprocal_w = gradient_at(&setup->reciprocal_w, offset_x, offset_y);
+  span.u_over_w = gradient_at(&setup->u_over_w, offset_x, offset_y);
+  span.v_over_w = gradient_at(&setup->v_over_w, offset_x, offset_y);
+
+  bool drew = false;
+  for (span.y = y_start; span.y <= y_end; span.y++) {
+    drew |= kernel(setup, &span, &color_buffer[window_width * span.y],
+                   &z_buffer[window_width * span.y]);
+
+    span.edges[0] += edge_dy[0];
+    span.edges[1] += edge_dy[1];
+    span.edges[2] += edge_dy[2];
+    span.reciprocal_w += setup->reciprocal_w.dy;
+    span.u_over_w += setup->u_over_w.dy;
+    span.v_over_w += setup->v_over_w.dy;
+  }
+
+  if (drew) {
+    // by block index: x_start need not be at the start of a block, so
+    // stepping from it a block at a time can miss the last one
+    for (int block_x = x_start / Z_BLOCK_SIZE; block_x <= x_end / Z_BLOCK_SIZE;
+         block_x++) {
+      update_z_block(block_x, y_start / Z_BLOCK_SIZE);
+    }
+  }
+  return drew;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Walk the part of the bounding box of a set up triangle that falls inside the
+// given rectangle (inclusive) and hand it row by row to a span kernel, which
+// draws into color_buffer and the depth buffer. Pixels are either filled with
+// the solid color of the triangle or, when it has a texture, with the color
+// fetched from it. Nothing outside the rectangle is touched, which lets every
+// tile of the screen be drawn on its own thread. The rectangle can't be wider
+// than a tile, which keeps the edge functions of the spans within 32 bits.
+//
+// The rectangle is walked in rows of 8x8 blocks that line up with the blocks
+// of the hierarchical z-buffer. A block is skipped without touching a single
+// pixel when all of it is outside of one of the edges, or when even the
+// nearest point of the triangle over it is behind the farthest depth stored
+// for the block. Each run of neighbouring blocks left over is drawn as one set
+// of spans. Returns whether any pixel was drawn
+///////////////////////////////////////////////////////////////////////////////
+static bool rasterize_rect(const triangle_setup_t *setup, span_kernel_t kernel,
+                           uint32_t *color_buffer, int min_x, int min_y,
+                           int max_x, int max_y) {
+  if (min_x < setup->min_x)
+    min_x = setup->min_x;
+  if (min_y < setup->min_y)
+    min_y = setup->min_y;
+  if (max_x > setup->max_x)
+    max_x = setup->max_x;
+  if (max_y > setup->max_y)
+    max_y = setup->max_y;
+  if (min_x > max_x || min_y > max_y) {
+    return false;
+  }
+
+  // The edges and 1/w are tested at whichever corner of a block they are
+  // largest at, which is the same corner for every block
+  const gradient_t *rw = &setup->reciprocal_w;
+  int64_t edge_offset[3];
+  for (int i = 0; i < 3; i++) {
+    edge_offset[i] =
+        edge_rise(&setup->edges[i], Z_BLOCK_SIZE - 1, Z_BLOCK_SIZE - 1);
+  }
+  float rw_offset = fmaxf(rw->dx * (Z_BLOCK_SIZE - 1), 0) +
+                    fmaxf(rw->dy * (Z_BLOCK_SIZE - 1), 0);
+
+  int first_block_x = min_x & ~(Z_BLOCK_SIZE - 1);
+  bool drew = false;
+  for (int block_y = min_y & ~(Z_BLOCK_SIZE - 1); block_y <= max_y;
+       block_y += Z_BLOCK_SIZE) {
+    int y_start = block_y > min_y ? block_y : min_y;
+    int y_end = block_y + Z_BLOCK_SIZE - 1 < max_y ? block_y + Z_BLOCK_SIZE - 1
+                                                   : max_y;
+
+    int offset_x = first_block_x - setup->min_x;
+    int offset_y = block_y - setup->min_y;
+    int64_t edge_corner[3];
+    for (int i = 0; i < 3; i++) {
+      edge_corner[i] =
+          edge_at(&setup->edges[i], offset_x, offset_y) + edge_offset[i];
+    }
+    float rw_corner = gradient_at(rw, offset_x, offset_y) + rw_offset;
+
+    // x_start of the current run of visible blocks, -1 while there is none
+    int run_start = -1;
+    for (int block_x = first_block_x; block_x <= max_x;
+         block_x += Z_BLOCK_SIZE) {
+      // 1/w over the block never goes beyond its largest value at a vertex
+      float nearest_depth = 1.0 - rw_corner;
+      if (nearest_depth < setup->min_depth) {
+        nearest_depth = setup->min_depth;
+      }
+      bool visible =
+          edge_corner[0] >= 0 && edge_corner[1] >= 0 && edge_corner[2] >= 0 &&
+          nearest_depth < get_z_block_far(block_x / Z_BLOCK_SIZE,
+                                          block_y / Z_BLOCK_SIZE);
+
+      int x_start = block_x > min_x ? block_x : min_x;
+      if (visible && run_start < 0) {
+        run_start = x_start;
+      } else if (!visible && run_start >= 0) {
+        drew |= draw_block_run(setup, kernel, color_buffer, run_start,
+                               y_start, x_start - 1, y_end);
+        run_start = -1;
       }
 
-      for (int x = x_start; x < x_end; x++) {
-        // Draw our pixel with the color that comes from the texture
-        draw_texel(x, y, texture, point_a, point_b, point_c, a_uv, b_uv, c_uv);
+      for (int i = 0; i < 3; i++) {
+        edge_corner[i] += (int64_t)setup->edges[i].dx * Z_BLOCK_SIZE;
       }
+      rw_corner += rw->dx * Z_BLOCK_SIZE;
     }
+    if (run_start >= 0) {
+      drew |= draw_block_run(setup, kernel, color_buffer, run_start, y_start,
+                             max_x, y_end);
+    }
+  }
+  return drew;
+}
+
+bool rasterize_triangle_in_rect(const triangle_setup_t *setup, int min_x,
+                                int min_y, int max_x, int max_y) {
+  // The SIMD kernels only address tiled textures, so textures that could not
+  // be tiled stay on the scalar path
+  span_kernel_t kernel = filled_span_kernel;
+  if (setup->texture != NULL) {
+    kernel = setup->texture->tiled ? textured_span_kernel : draw_textured_span;
+  }
+  return rasterize_rect(setup, kernel, get_color_buffer(), min_x, min_y, max_x,
+                        max_y);
+}
+
+/**
+ * Depth-only pass of a visibility buffer: the triangle is drawn as if it had
+ * the solid color id, into id_buffer instead of the color buffer, so every
+ * pixel it wins the depth test for ends up holding its id
+ **/
+bool rasterize_triangle_id_in_rect(const triangle_setup_t *setup, uint32_t id,
+                                   uint32_t *id_buffer, int min_x, int min_y,
+                                   int max_x, int max_y) {
+  triangle_setup_t id_setup = *setup;
+  id_setup.texture = NULL;
+  id_setup.color = id;
+  return rasterize_rect(&id_setup, filled_span_kernel, id_buffer, min_x, min_y,
+                        max_x, max_y);
+}
+
+/**
+ * Color the pixels x_start to x_end (inclusive) of a color buffer row with a
+ * set up triangle: its texels there, or its solid color when it has no
+ * texture. This is the shading half of drawing those pixels, without the edge
+ * and depth tests
+ **/
+void shade_triangle_run(const triangle_setup_t *setup, uint32_t *color_row,
+                        int y, int x_start, int x_end) {
+  if (setup->texture == NULL) {
+    for (int x = x_start; x <= x_end; x++) {
+      color_row[x] = setup->color;
+    }
+    return;
+  }
+  int offset_x = x_start - setup->min_x;
+  int offset_y = y - setup->min_y;
+  float reciprocal_w = gradient_at(&setup->reciprocal_w, offset_x, offset_y);
+  float u_over_w = gradient_at(&setup->u_over_w, offset_x, offset_y);
+  float v_over_w = gradient_at(&setup->v_over_w, offset_x, offset_y);
+  for (int x = x_start; x <= x_end; x++) {
+    color_row[x] =
+        sample_texture(setup->texture, reciprocal_w, u_over_w, v_over_w);
+    reciprocal_w += setup->reciprocal_w.dx;
+    u_over_w += setup->u_over_w.dx;
+    v_over_w += setup->v_over_w.dx;
+  }
+}
+
+void rasterize_triangle(const triangle_setup_t *setup) {
+  // Go through the bounding box one tile at a time, since that is as wide as
+  // rasterize_triangle_in_rect() goes
+  for (int y = setup->min_y; y <= setup->max_y; y += Z_TILE_SIZE) {
+    for (int x = setup->min_x; x <= setup->max_x; x += Z_TILE_SIZE) {
+      rasterize_triangle_in_rect(setup, x, y, x + Z_TILE_SIZE - 1,
+                                 y + Z_TILE_SIZE - 1);
+    }
+  }
+}
+
+/**
+ * Set up a projected triangle the way draw_filled_triangle() or
+ * draw_textured_triangle() would before drawing it, but keeping the sub-pixel
+ * part of its screen positions
+ **/
+bool setup_triangle_to_render(triangle_setup_t *setup,
+                              const triangle_t *triangle, bool textured) {
+  vec4_t points[3];
+  tex2_t uvs[3];
+  for (int i = 0; i < 3; i++) {
+    points[i] = triangle->points[i];
+    // Flip the V component to account for inverted UV-coordinates
+    uvs[i] = (tex2_t){triangle->texcoords[i].u,
+                      1.0 - triangle->texcoords[i].v};
+  }
+
+  if (textured) {
+    return setup_triangle(setup, points[0], points[1], points[2], uvs[0],
+                          uvs[1], uvs[2], triangle->texture, 0);
+  }
+  tex2_t no_uv = {0, 0};
+  return setup_triangle(setup, points[0], points[1], points[2], no_uv, no_uv,
+                        no_uv, NULL, triangle->color);
+}
+
+void draw_filled_triangle(int x0, int y0, float z0, float w0, int x1, int y1,
+                          float z1, float w1, int x2, int y2, float z2,
+                          float w2, uint32_t color) {
+  vec4_t point_a = {x0, y0, z0, w0};
+  vec4_t point_b = {x1, y1, z1, w1};
+  vec4_t point_c = {x2, y2, z2, w2};
+  tex2_t no_uv = {0, 0};
+
+  triangle_setup_t setup;
+  if (setup_triangle(&setup, point_a, point_b, point_c, no_uv, no_uv, no_uv,
+                     NULL, color)) {
+    rasterize_triangle(&setup);
+  }
+}
+
+void draw_textured_triangle(int x0, int y0, float z0, float w0, float u0,
+                            float v0, int x1, int y1, float z1, float w1,
+                            float u1, float v1, int x2, int y2, float z2,
+                            float w2, float u2, float v2, texture_t *texture) {
+  // Flip the V component to account for inverted UV-coordinates (V grows
+  // downwards)
+  v0 = 1.0 - v0;
+  v1 = 1.0 - v1;
+  v2 = 1.0 - v2;
+
+  vec4_t point_a = {x0, y0, z0, w0};
+  vec4_t point_b = {x1, y1, z1, w1};
+  vec4_t point_c = {x2, y2, z2, w2};
+  tex2_t a_uv = {u0, v0};
+  tex2_t b_uv = {u1, v1};
+  tex2_t c_uv = {u2, v2};
+
+  triangle_setup_t setup;
+  if (setup_triangle(&setup, point_a, point_b, point_c, a_uv, b_uv, c_uv,
+                     texture, 0)) {
+    rasterize_triangle(&setup);
   }
 }
 
@@ -4,6 +4,7 @@
 #include "texture.h"
 #include "upng.h"
 #include "vector.h"
+#include <stdbool.h>
 #include <stdint.h>
 
 // face_t stores indices of vertices (corner 1, 2, 3)
@@ -23,16 +24,101 @@ typedef struct {
   vec4_t points[3];
   tex2_t texcoords[3];
   uint32_t color;
-  upng_t *texture;
+  texture_t *texture;
 } triangle_t;
 
+// gradient_t is a value that varies linearly across the screen: its value at
+// the setup origin (the center of the top-left pixel of the triangle's
+// bounding box) and how much it changes per pixel in x and in y
+typedef struct {
+  float value;
+  float dx;
+  float dy;
+} gradient_t;
+
+// Screen positions are snapped to fixed point with SUBPIXEL_BITS fractional
+// bits (28.4) before a triangle is rasterized, so which pixels it covers is
+// decided with exact integer math
+#define SUBPIXEL_BITS 4
+#define SUBPIXEL_ONE (1 << SUBPIXEL_BITS)
+
+// edge_t is the edge function of one triangle edge in fixed point. It is
+// exact, so a pixel on an edge shared by two triangles is always inside
+// exactly one of them
+typedef struct {
+  int64_t value; // at the setup origin, fill rule bias included
+  int32_t dx;    // change per pixel to the right
+  int32_t dy;    // change per pixel down
+} edge_t;
+
+// triangle_setup_t holds everything the rasterizer needs to draw a projected
+// triangle, computed once per triangle by setup_triangle()
+typedef struct {
+  int min_x; // screen bounding box, clamped to the window
+  int min_y;
+  int max_x;
+  int max_y;
+  edge_t edges[3];         // a pixel is covered when all three are >= 0
+  gradient_t reciprocal_w; // 1/w
+  gradient_t u_over_w;     // u/w
+  gradient_t v_over_w;     // v/w
+  float min_depth;         // nearest depth of the triangle (smallest 1 - 1/w)
+  texture_t *texture;      // mip level to sample, NULL for solid color
+  uint32_t color;
+} triangle_setup_t;
+
+// span_t is one row of a set up triangle, from x_start to x_end inclusive,
+// with every interpolant evaluated at its first pixel. The edge functions are
+// relative to the part of the triangle being drawn so they fit in 32 bits, and
+// edges the whole span is inside of are 0 with no step
+typedef struct {
+  int y;
+  int x_start;
+  int x_end;
+  int32_t edges[3];
+  int32_t edge_dx[3];
+  float reciprocal_w;
+  float u_over_w;
+  float v_over_w;
+} span_t;
+
+// A span kernel draws the covered pixels of a span into the color and depth
+// buffer rows it lives on. Pixels are stepped with the gradients of the setup.
+// Returns whether any pixel passed the depth test and was drawn
+typedef bool (*span_kernel_t)(const triangle_setup_t *setup, const span_t *span,
+                              uint32_t *color_row, float *depth_row);
+
 void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2,
                    uint32_t color);
 void draw_filled_triangle(int x0, int y0, float z0, float w0, int x1, int y1,
                           float z1, float w1, int x2, int y2, float z2,
                           float w2, uint32_t color);
-void draw_texel(int x, int y, upng_t *texture, vec4_t point_a, vec4_t point_b,
-                vec4_t point_c, tex2_t a_uv, tex2_t b_uv, tex2_t c_uv);
+bool setup_triangle(triangle_setup_t *setup, vec4_t point_a, vec4_t point_b,
+                    vec4_t point_c, tex2_t a_uv, tex2_t b_uv, tex2_t c_uv,
+                    texture_t *texture, uint32_t color);
+void init_span_kernels(void);
+bool draw_filled_span(const triangle_setup_t *setup, const span_t *span,
+                      uint32_t *color_row, float *depth_row);
+bool draw_textured_span(const triangle_setup_t *setup, const span_t *span,
+                        uint32_t *color_row, float *depth_row);
+void rasterize_triangle(const triangle_setup_t *setup);
+bool rasterize_triangle_in_rect(const triangle_setup_t *setup, int min_x,
+                                int min_y, int max_x, int max_y);
+bool rasterize_triangle_id_in_rect(const triangle_setup_t *setup, uint32_t id,
+                                   uint32_t *id_buffer, int min_x, int min_y,
+                                   int max_x, int max_y);
+void shade_triangle_run(const triangle_setup_t *setup, uint32_t *color_row,
+                        int y, int x_start, int x_end);
+bool triangle_overlaps_rect(const triangle_setup_t *setup, int min_x,
+                            int min_y, int max_x, int max_y);
+bool setup_triangle_to_render(triangle_setup_t *setup,
+                              const triangle_t *triangle, bool textured);
+bool draw_triangle_pixel(uint32_t *pixel, float *depth,
+                         const triangle_setup_t *setup,
+                         float interpolated_reciprocal_w);
+bool draw_texel(uint32_t *pixel, float *depth, const triangle_setup_t *setup,
+                float interpolated_reciprocal_w, float interpolated_u_over_w,
+                float interpolated_v_over_w);
 // AFFINE MAPPING (draw_texel):
 /*
 void draw_texel(
@@ -54,6 +140,6 @@ void draw_textured_triangle(
 void draw_textured_triangle(int x0, int y0, float z0, float w0, float u0,
                             float v0, int x1, int y1, float z1, float w1,
                             float u1, float v1, int x2, int y2, float z2,
-                            float w2, float u2, float v2, upng_t *texture);
+                            float w2, float u2, float v2, texture_t *texture);
 
 #endif
@@ -0,0 +1,413 @@
+#include "triangle_simd.h"
+
+#if TRIANGLE_SIMD_X86
+#include <immintrin.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// SIMD span kernels
+///////////////////////////////////////////////////////////////////////////////
+// These do the work of draw_triangle_pixel() and draw_texel() for 4 (SSE2) or
+// 8 (AVX2) horizontally adjacent pixels at once: coverage from the three edge
+// functions, depth compare against the z-buffer, and only if any lane survives
+// both, the perspective divide, texel fetch and masked store.
+//
+// Most of our triangles are only a handful of pixels wide, so rather than
+// peeling off scalar pixels at both ends of a span the kernels walk groups of
+// pixels aligned to the vector width and mask off the lanes that fall outside
+// the span. Masked-off lanes are never read from or written to memory, which
+// keeps the kernels inside the row even when the window width is not a
+// multiple of the vector width. Textures are wrapped with a mask and addressed
+// in tiles, so the caller only sends tiled textures here.
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+// SSE2: 4 pixels at a time
+///////////////////////////////////////////////////////////////////////////////
+__attribute__((target("sse2"))) static __m128
+gradient_lanes_sse2(float start, float dx) {
+  return _mm_add_ps(_mm_set1_ps(start),
+                    _mm_mul_ps(_mm_setr_ps(0, 1, 2, 3), _mm_set1_ps(dx)));
+}
+
+// Edge function of span edge i for the 4 pixels starting lead pixels before
+// the first pixel of the span
+__attribute__((target("sse2"))) static __m128i
+edge_lanes_sse2(const span_t *span, int i, int lead) {
+  int32_t dx = span->edge_dx[i];
+  return _mm_add_epi32(_mm_set1_epi32(span->edges[i] - lead * dx),
+                       _mm_setr_epi32(0, dx, 2 * dx, 3 * dx));
+}
+
+// Lanes whose pixel is inside the span and covered by the triangle, which is
+// when none of the three edge functions has its sign bit set
+__attribute__((target("sse2"))) static __m128
+covered_lanes_sse2(__m128i lane_x, const span_t *span, __m128i w0, __m128i w1,
+                   __m128i w2) {
+  __m128i in_span =
+      _mm_and_si128(_mm_cmpgt_epi32(lane_x, _mm_set1_epi32(span->x_start - 1)),
+                    _mm_cmplt_epi32(lane_x, _mm_set1_epi32(span->x_end + 1)));
+  __m128i covered = _mm_cmpgt_epi32(
+      _mm_or_si128(_mm_or_si128(w0, w1), w2), _mm_set1_epi32(-1));
+  return _mm_castsi128_ps(_mm_and_si128(covered, in_span));
+}
+
+// SSE2 has no masked loads, so partially covered groups are loaded lane by lane
+__attribute__((target("sse2"))) static __m128
+load_depth_lanes_sse2(const float *depth_row, int x, int mask) {
+  if (mask == 0xF) {
+    return _mm_loadu_ps(&depth_row[x]);
+  }
+  float depths[4] = {0, 0, 0, 0};
+  for (int i = 0; i < 4; i++) {
+    if (mask & (1 << i)) {
+      depths[i] = depth_row[x + i];
+    }
+  }
+  return _mm_loadu_ps(depths);
+}
+
+__attribute__((target("sse2"))) bool
+draw_filled_span_sse2(const triangle_setup_t *setup, const span_t *span,
+                      uint32_t *color_row, float *depth_row) {
+  // Start at the group of 4 the first pixel of the span falls in
+  int x = span->x_start & ~3;
+  int lead = span->x_start - x;
+  float offset = -lead;
+  __m128i w0 = edge_lanes_sse2(span, 0, lead);
+  __m128i w1 = edge_lanes_sse2(span, 1, lead);
+  __m128i w2 = edge_lanes_sse2(span, 2, lead);
+  __m128 reciprocal_w = gradient_lanes_sse2(
+      span->reciprocal_w + setup->reciprocal_w.dx * offset,
+      setup->reciprocal_w.dx);
+  __m128i w0_step = _mm_set1_epi32(span->edge_dx[0] * 4);
+  __m128i w1_step = _mm_set1_epi32(span->edge_dx[1] * 4);
+  __m128i w2_step = _mm_set1_epi32(span->edge_dx[2] * 4);
+  __m128 reciprocal_w_step = _mm_set1_ps(setup->reciprocal_w.dx * 4);
+  __m128i lane_x = _mm_add_epi32(_mm_set1_epi32(x), _mm_setr_epi32(0, 1, 2, 3));
+  __m128i lane_x_step = _mm_set1_epi32(4);
+  __m128 one = _mm_set1_ps(1.0f);
+  __m128i color = _mm_set1_epi32(setup->color);
+  bool was_inside = false;
+  bool drew = false;
+
+  for (; x <= span->x_end; x += 4) {
+    __m128 covered = covered_lanes_sse2(lane_x, span, w0, w1, w2);
+    int covered_mask = _mm_movemask_ps(covered);
+
+    if (covered_mask != 0) {
+      was_inside = true;
+      __m128 depth = _mm_sub_ps(one, reciprocal_w);
+      __m128 old_depth = load_depth_lanes_sse2(depth_row, x, covered_mask);
+      __m128 visible = _mm_and_ps(covered, _mm_cmplt_ps(depth, old_depth));
+      int mask = _mm_movemask_ps(visible);
+
+      drew |= mask != 0;
+      if (mask == 0xF) {
+        _mm_storeu_si128((__m128i *)&color_row[x], color);
+        _mm_storeu_ps(&depth_row[x], depth);
+      } else if (mask != 0) {
+        float depths[4];
+        _mm_storeu_ps(depths, depth);
+        for (int i = 0; i < 4; i++) {
+          if (mask & (1 << i)) {
+            color_row[x + i] = setup->color;
+            depth_row[x + i] = depths[i];
+          }
+        }
+      }
+    } else if (was_inside) {
+      // A triangle is convex, so once we leave it there is nothing more to
+      // draw on this row
+      break;
+    }
+
+    w0 = _mm_add_epi32(w0, w0_step);
+    w1 = _mm_add_epi32(w1, w1_step);
+    w2 = _mm_add_epi32(w2, w2_step);
+    reciprocal_w = _mm_add_ps(reciprocal_w, reciprocal_w_step);
+    lane_x = _mm_add_epi32(lane_x, lane_x_step);
+  }
+  return drew;
+}
+
+__attribute__((target("sse2"))) bool
+draw_textured_span_sse2(const triangle_setup_t *setup, const span_t *span,
+                        uint32_t *color_row, float *depth_row) {
+  const texture_t *texture = setup->texture;
+  int x = span->x_start & ~3;
+  int lead = span->x_start - x;
+  float offset = -lead;
+  __m128i w0 = edge_lanes_sse2(span, 0, lead);
+  __m128i w1 = edge_lanes_sse2(span, 1, lead);
+  __m128i w2 = edge_lanes_sse2(span, 2, lead);
+  __m128 reciprocal_w = gradient_lanes_sse2(
+      span->reciprocal_w + setup->reciprocal_w.dx * offset,
+      setup->reciprocal_w.dx);
+  __m128 u_over_w = gradient_lanes_sse2(
+      span->u_over_w + setup->u_over_w.dx * offset, setup->u_over_w.dx);
+  __m128 v_over_w = gradient_lanes_sse2(
+      span->v_over_w + setup->v_over_w.dx * offset, setup->v_over_w.dx);
+  __m128i w0_step = _mm_set1_epi32(span->edge_dx[0] * 4);
+  __m128i w1_step = _mm_set1_epi32(span->edge_dx[1] * 4);
+  __m128i w2_step = _mm_set1_epi32(span->edge_dx[2] * 4);
+  __m128 reciprocal_w_step = _mm_set1_ps(setup->reciprocal_w.dx * 4);
+  __m128 u_over_w_step = _mm_set1_ps(setup->u_over_w.dx * 4);
+  __m128 v_over_w_step = _mm_set1_ps(setup->v_over_w.dx * 4);
+  __m128i lane_x = _mm_add_epi32(_mm_set1_epi32(x), _mm_setr_epi32(0, 1, 2, 3));
+  __m128i lane_x_step = _mm_set1_epi32(4);
+  __m128 one = _mm_set1_ps(1.0f);
+  __m128 texture_width = _mm_set1_ps(texture->width);
+  __m128 texture_height = _mm_set1_ps(texture->height);
+  __m128i wrap_x = _mm_set1_epi32(texture->width - 1);
+  __m128i wrap_y = _mm_set1_epi32(texture->height - 1);
+  __m128i tile_row_shift = _mm_cvtsi32_si128(texture->width_shift);
+  __m128i tile_mask = _mm_set1_epi32(~3);
+  __m128i in_tile_mask = _mm_set1_epi32(3);
+  bool was_inside = false;
+  bool drew = false;
+
+  for (; x <= span->x_end; x += 4) {
+    __m128 covered = covered_lanes_sse2(lane_x, span, w0, w1, w2);
+    int covered_mask = _mm_movemask_ps(covered);
+
+    if (covered_mask != 0) {
+      was_inside = true;
+      __m128 depth = _mm_sub_ps(one, reciprocal_w);
+      __m128 old_depth = load_depth_lanes_sse2(depth_row, x, covered_mask);
+      __m128 visible = _mm_and_ps(covered, _mm_cmplt_ps(depth, old_depth));
+      int mask = _mm_movemask_ps(visible);
+
+      if (mask != 0) {
+        drew = true;
+        // Divide back by 1/w and map UV to texel coordinates, wrapped into
+        // the texture and addressed in tiles the same way draw_texel does
+        __m128 w = _mm_div_ps(one, reciprocal_w);
+        __m128i tex_x = _mm_and_si128(
+            _mm_cvttps_epi32(_mm_mul_ps(_mm_mul_ps(u_over_w, w), texture_width)),
+            wrap_x);
+        __m128i tex_y = _mm_and_si128(
+            _mm_cvttps_epi32(
+                _mm_mul_ps(_mm_mul_ps(v_over_w, w), texture_height)),
+            wrap_y);
+        __m128i index = _mm_add_epi32(
+            _mm_add_epi32(
+                _mm_sll_epi32(_mm_and_si128(tex_y, tile_mask), tile_row_shift),
+                _mm_slli_epi32(
+                    _mm_or_si128(_mm_and_si128(tex_x, tile_mask),
+                                 _mm_and_si128(tex_y, in_tile_mask)),
+                    2)),
+            _mm_and_si128(tex_x, in_tile_mask));
+
+        // There is no gather before AVX2, so fetch and store lane by lane
+        int indices[4];
+        float depths[4];
+        _mm_storeu_si128((__m128i *)indices, index);
+        _mm_storeu_ps(depths, depth);
+        for (int i = 0; i < 4; i++) {
+          if (mask & (1 << i)) {
+            color_row[x + i] = texture->texels[indices[i]];
+            depth_row[x + i] = depths[i];
+          }
+        }
+      }
+    } else if (was_inside) {
+      break;
+    }
+
+    w0 = _mm_add_epi32(w0, w0_step);
+    w1 = _mm_add_epi32(w1, w1_step);
+    w2 = _mm_add_epi32(w2, w2_step);
+    reciprocal_w = _mm_add_ps(reciprocal_w, reciprocal_w_step);
+    u_over_w = _mm_add_ps(u_over_w, u_over_w_step);
+    v_over_w = _mm_add_ps(v_over_w, v_over_w_step);
+    lane_x = _mm_add_epi32(lane_x, lane_x_step);
+  }
+  return drew;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AVX2: 8 pixels at a time
+///////////////////////////////////////////////////////////////////////////////
+__attribute__((target("avx2"))) static __m256
+gradient_lanes_avx2(float start, float dx) {
+  return _mm256_add_ps(
+      _mm256_set1_ps(start),
+      _mm256_mul_ps(_mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_ps(dx)));
+}
+
+// Edge function of span edge i for the 8 pixels starting lead pixels before
+// the first pixel of the span
+__attribute__((target("avx2"))) static __m256i
+edge_lanes_avx2(const span_t *span, int i, int lead) {
+  int32_t dx = span->edge_dx[i];
+  return _mm256_add_epi32(
+      _mm256_set1_epi32(span->edges[i] - lead * dx),
+      _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                         _mm256_set1_epi32(dx)));
+}
+
+// Lanes whose pixel is inside the span and covered by the triangle, which is
+// when none of the three edge functions has its sign bit set
+__attribute__((target("avx2"))) static __m256
+covered_lanes_avx2(__m256i lane_x, const span_t *span, __m256i w0, __m256i w1,
+                   __m256i w2) {
+  __m256i in_span = _mm256_and_si256(
+      _mm256_cmpgt_epi32(lane_x, _mm256_set1_epi32(span->x_start - 1)),
+      _mm256_cmpgt_epi32(_mm256_set1_epi32(span->x_end + 1), lane_x));
+  __m256i covered = _mm256_cmpgt_epi32(
+      _mm256_or_si256(_mm256_or_si256(w0, w1), w2), _mm256_set1_epi32(-1));
+  return _mm256_castsi256_ps(_mm256_and_si256(covered, in_span));
+}
+
+__attribute__((target("avx2"))) bool
+draw_filled_span_avx2(const triangle_setup_t *setup, const span_t *span,
+                      uint32_t *color_row, float *depth_row) {
+  // Start at the group of 8 the first pixel of the span falls in
+  int x = span->x_start & ~7;
+  int lead = span->x_start - x;
+  float offset = -lead;
+  __m256i w0 = edge_lanes_avx2(span, 0, lead);
+  __m256i w1 = edge_lanes_avx2(span, 1, lead);
+  __m256i w2 = edge_lanes_avx2(span, 2, lead);
+  __m256 reciprocal_w = gradient_lanes_avx2(
+      span->reciprocal_w + setup->reciprocal_w.dx * offset,
+      setup->reciprocal_w.dx);
+  __m256i w0_step = _mm256_set1_epi32(span->edge_dx[0] * 8);
+  __m256i w1_step = _mm256_set1_epi32(span->edge_dx[1] * 8);
+  __m256i w2_step = _mm256_set1_epi32(span->edge_dx[2] * 8);
+  __m256 reciprocal_w_step = _mm256_set1_ps(setup->reciprocal_w.dx * 8);
+  __m256i lane_x = _mm256_add_epi32(_mm256_set1_epi32(x),
+                                    _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+  __m256i lane_x_step = _mm256_set1_epi32(8);
+  __m256 one = _mm256_set1_ps(1.0f);
+  __m256i color = _mm256_set1_epi32(setup->color);
+  bool was_inside = false;
+  bool drew = false;
+
+  for (; x <= span->x_end; x += 8) {
+    __m256 covered = covered_lanes_avx2(lane_x, span, w0, w1, w2);
+
+    if (_mm256_movemask_ps(covered) != 0) {
+      was_inside = true;
+      __m256 depth = _mm256_sub_ps(one, reciprocal_w);
+      __m256 old_depth =
+          _mm256_maskload_ps(&depth_row[x], _mm256_castps_si256(covered));
+      __m256 visible =
+          _mm256_and_ps(covered, _mm256_cmp_ps(depth, old_depth, _CMP_LT_OQ));
+
+      if (_mm256_movemask_ps(visible) != 0) {
+        drew = true;
+        __m256i mask = _mm256_castps_si256(visible);
+        _mm256_maskstore_epi32((int *)&color_row[x], mask, color);
+        _mm256_maskstore_ps(&depth_row[x], mask, depth);
+      }
+    } else if (was_inside) {
+      // A triangle is convex, so once we leave it there is nothing more to
+      // draw on this row
+      break;
+    }
+
+    w0 = _mm256_add_epi32(w0, w0_step);
+    w1 = _mm256_add_epi32(w1, w1_step);
+    w2 = _mm256_add_epi32(w2, w2_step);
+    reciprocal_w = _mm256_add_ps(reciprocal_w, reciprocal_w_step);
+    lane_x = _mm256_add_epi32(lane_x, lane_x_step);
+  }
+  return drew;
+}
+
+__attribute__((target("avx2"))) bool
+draw_textured_span_avx2(const triangle_setup_t *setup, const span_t *span,
+                        uint32_t *color_row, float *depth_row) {
+  const texture_t *texture = setup->texture;
+  int x = span->x_start & ~7;
+  int lead = span->x_start - x;
+  float offset = -lead;
+  __m256i w0 = edge_lanes_avx2(span, 0, lead);
+  __m256i w1 = edge_lanes_avx2(span, 1, lead);
+  __m256i w2 = edge_lanes_avx2(span, 2, lead);
+  __m256 reciprocal_w = gradient_lanes_avx2(
+      span->reciprocal_w + setup->reciprocal_w.dx * offset,
+      setup->reciprocal_w.dx);
+  __m256 u_over_w = gradient_lanes_avx2(
+      span->u_over_w + setup->u_over_w.dx * offset, setup->u_over_w.dx);
+  __m256 v_over_w = gradient_lanes_avx2(
+      span->v_over_w + setup->v_over_w.dx * offset, setup->v_over_w.dx);
+  __m256i w0_step = _mm256_set1_epi32(span->edge_dx[0] * 8);
+  __m256i w1_step = _mm256_set1_epi32(span->edge_dx[1] * 8);
+  __m256i w2_step = _mm256_set1_epi32(span->edge_dx[2] * 8);
+  __m256 reciprocal_w_step = _mm256_set1_ps(setup->reciprocal_w.dx * 8);
+  __m256 u_over_w_step = _mm256_set1_ps(setup->u_over_w.dx * 8);
+  __m256 v_over_w_step = _mm256_set1_ps(setup->v_over_w.dx * 8);
+  __m256i lane_x = _mm256_add_epi32(_mm256_set1_epi32(x),
+                                    _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+  __m256i lane_x_step = _mm256_set1_epi32(8);
+  __m256 one = _mm256_set1_ps(1.0f);
+  __m256 texture_width = _mm256_set1_ps(texture->width);
+  __m256 texture_height = _mm256_set1_ps(texture->height);
+  __m256i wrap_x = _mm256_set1_epi32(texture->width - 1);
+  __m256i wrap_y = _mm256_set1_epi32(texture->height - 1);
+  __m128i tile_row_shift = _mm_cvtsi32_si128(texture->width_shift);
+  __m256i tile_mask = _mm256_set1_epi32(~3);
+  __m256i in_tile_mask = _mm256_set1_epi32(3);
+  bool was_inside = false;
+  bool drew = false;
+
+  for (; x <= span->x_end; x += 8) {
+    __m256 covered = covered_lanes_avx2(lane_x, span, w0, w1, w2);
+
+    if (_mm256_movemask_ps(covered) != 0) {
+      was_inside = true;
+      __m256 depth = _mm256_sub_ps(one, reciprocal_w);
+      __m256 old_depth =
+          _mm256_maskload_ps(&depth_row[x], _mm256_castps_si256(covered));
+      __m256 visible =
+          _mm256_and_ps(covered, _mm256_cmp_ps(depth, old_depth, _CMP_LT_OQ));
+
+      if (_mm256_movemask_ps(visible) != 0) {
+        drew = true;
+        // Divide back by 1/w and map UV to texel coordinates, wrapped into
+        // the texture and addressed in tiles the same way draw_texel does
+        __m256 w = _mm256_div_ps(one, reciprocal_w);
+        __m256i tex_x = _mm256_and_si256(
+            _mm256_cvttps_epi32(
+                _mm256_mul_ps(_mm256_mul_ps(u_over_w, w), texture_width)),
+            wrap_x);
+        __m256i tex_y = _mm256_and_si256(
+            _mm256_cvttps_epi32(
+                _mm256_mul_ps(_mm256_mul_ps(v_over_w, w), texture_height)),
+            wrap_y);
+        __m256i index = _mm256_add_epi32(
+            _mm256_add_epi32(
+                _mm256_sll_epi32(_mm256_and_si256(tex_y, tile_mask),
+                                 tile_row_shift),
+                _mm256_slli_epi32(
+                    _mm256_or_si256(_mm256_and_si256(tex_x, tile_mask),
+                                    _mm256_and_si256(tex_y, in_tile_mask)),
+                    2)),
+            _mm256_and_si256(tex_x, in_tile_mask));
+
+        // Gather and store only the visible lanes
+        __m256i mask = _mm256_castps_si256(visible);
+        __m256i color = _mm256_mask_i32gather_epi32(
+            _mm256_setzero_si256(), (const int *)texture->texels, index, mask,
+            4);
+        _mm256_maskstore_epi32((int *)&color_row[x], mask, color);
+        _mm256_maskstore_ps(&depth_row[x], mask, depth);
+      }
+    } else if (was_inside) {
+      break;
+    }
+
+    w0 = _mm256_add_epi32(w0, w0_step);
+    w1 = _mm256_add_epi32(w1, w1_step);
+    w2 = _mm256_add_epi32(w2, w2_step);
+    reciprocal_w = _mm256_add_ps(reciprocal_w, reciprocal_w_step);
+    u_over_w = _mm256_add_ps(u_over_w, u_over_w_step);
+    v_over_w = _mm256_add_ps(v_over_w, v_over_w_step);
+    lane_x = _mm256_add_epi32(lane_x, lane_x_step);
+  }
+  return drew;
+}
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef TRIANGLE_SIMD_H
+#define TRIANGLE_SIMD_H
+
+#include "triangle.h"
+#include <stdbool.h>
+
+// The SIMD span kernels are built for x86 only, using per-function target
+// attributes so the rest of the program keeps compiling for the baseline CPU.
+// Which ones actually run is decided at startup by init_span_kernels()
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define TRIANGLE_SIMD_X86 1
+#else
+#define TRIANGLE_SIMD_X86 0
+#endif
+
+#if TRIANGLE_SIMD_X86
+// 4 pixels at a time
+bool draw_filled_span_sse2(const triangle_setup_t *setup, const span_t *span,
+                           uint32_t *color_row, float *depth_row);
+bool draw_textured_span_sse2(const triangle_setup_t *setup, const span_t *span,
+                             uint32_t *color_row, float *depth_row);
+
+// 8 pixels at a time
+bool draw_filled_span_avx2(const triangle_setup_t *setup, const span_t *span,
+                           uint32_t *color_row, float *depth_row);
+bool draw_textured_span_avx2(const triangle_setup_t *setup, const span_t *span,
+                             uint32_t *color_row, float *depth_row);
+#endif
+
+#endif
@@ -72,6 +72,11 @@ vec3_t vec3_clone(vec3_t *v) {
   return result;
 }
 
+/**
+ * Get the length (magnitude) of a 3D vector
+ */
+float vec3_length(vec3_t v) { return sqrt(v.x * v.x + v.y * v.y + v.z * v.z); }
+
 /**
  * Get the sum of two 3D vectors
  */
@@ -123,6 +128,13 @@ float vec3_dot(vec3_t a, vec3_t b) {
   return (a.x * b.x) + (a.y * b.y) + (a.z * b.z);
 }
 
+/**
+ * Check if two 3D vectors are exactly the same
+ */
+bool vec3_equal(vec3_t a, vec3_t b) {
+  return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
 void vec3_normalize(vec3_t *v) {
   float length = sqrt(v->x * v->x + v->y * v->y + v->z * v->z);
   v->x /= length;
@@ -1,6 +1,8 @@
 #ifndef VECTOR_H
 #define VECTOR_H
 
+#include <stdbool.h>
+
 // a struct for 2D vectors containing each coordinate in the 2D plane
 typedef struct {
   float x;
@@ -42,6 +44,7 @@ vec3_t vec3_mul(vec3_t v, float factor);
 vec3_t vec3_div(vec3_t v, float factor);
 vec3_t vec3_cross(vec3_t a, vec3_t b); // find the cross product of two vectors
 float vec3_dot(vec3_t a, vec3_t b);
+bool vec3_equal(vec3_t a, vec3_t b);
 void vec3_normalize(vec3_t *v);
 
 vec3_t vec3_rotate_x(vec3_t v, float angle);